@@ -2,14 +2,51 @@
  * location, extracts it and creates a shortcut to the extracted executable in 
  * the Start menu.
  *
- * Usage: Installer.exe <program_name>
+ * Usage: Installer.exe [options] <program_name> [<program_name> ...]
+ *
+ * Options:
+ *     --debug         Log extra detail
+ *     --threads N     Worker threads for the run (default: one per processor)
+ *     --programdir D  Read applications from D instead of the server share
+ *     --no-stream     Copy the whole zip before extracting it
+ *     --benchmark     Time the copy engines, copy-then-extract against
+ *                     streaming, and extraction from the file against a
+ *                     mapping; no install
+ *     --delta         Hard link files whose size and CRC are unchanged from
+ *                     the installed version instead of extracting them
+ *     --no-cache      Always download; delete the local zip after extracting
+ *     --verify-cache  Also require the cached zip's CRC32 to match
+ *     --map           Read local zips through a memory mapping
+ *     --publish       Write release.ini for <program_name>'s server folder,
+ *                     naming its newest zip; no install
+ *     --batch F       Also install every application listed in F, one per
+ *                     line; with this or several names, installs run side
+ *                     by side and nothing is launched
+ *     --headless      No window: log messages and timed steps go to stdout
+ *                     as JSON lines; exits 0 ok, 1 failed, 2 bad usage,
+ *                     3 already running, 4 not found, 5 cancelled (Ctrl+C)
+ *     --appdata D     Use D in place of %LocalAppData% and the Start menu
+ *     --stats F       Write time, bytes, files and MB/s per install step and
+ *                     per function to F as JSON
+ *     --trace F       Write every timed step and call to F in Chrome trace
+ *                     format
+ *     --log F         Write the whole log to F as text when the run ends
+ *     --recompress M  With --publish, first rewrite the newest zip with method
+ *                     M (zstd, xz, lzma, bzip2, deflate or store) as
+ *                     <name>-M.zip and publish that one
  *
  * The zip file is extracted to the MyApps directory.
  * A shortcut is created in the Programs/MyApps Start menu.
+ * Steps 1-6 run on their own thread. Until the swap (STEP 4) the install 
+ * can be cancelled, which leaves the current version as it was.
+ * Each file's CRC32 is checked as it is extracted; a mismatch fails the 
+ * install before the swap and drops the zip from the cache.
  *
  * Dependencies:
  *      ZLib:    https://github.com/kiyolee/zlib-win-build.git
  *      LibZip:  https://github.com/kiyolee/libzip-win-build.git
+ *               built with zstd and liblzma for zstd and xz/lzma entries
+ *      LibDeflate: https://github.com/ebiggers/libdeflate.git
  *
  * Application and dependencies are statically linked so that the executable
  * is a single file.
@@ -22,15 +59,15 @@
  * - Check / Install / Upgrade local installer   (STEP 1)
  * - Download zip to %localappdata%\MyApps       (STEP 2)
  * - Check/fail if program is currently running
- * - Uninstall current version (if exists)       (STEP 3)
- * - Unzip file                                  (STEP 4)
- * - Create shortcut                             (STEP 5)
- * - Run app on exit                             (STEP 6)
+ * - Unzip file next to the current version      (STEP 3)
+ * - Swap it in with a single rename             (STEP 4)
+ * - Uninstall current version (if exists)       (STEP 5)
+ * - Create shortcut                             (STEP 6)
+ * - Run app on exit                             (STEP 7)
+ * - Delete the old version in the background
  *
  * TODO:
  * - Add DEBUG flag.
- * - Delete local copy of the application zip after extracting it.
- *      (This isn't working for some reason)
 */
 
 #include <stdio.h>
@@ -52,8 +89,13 @@
 #include <tchar.h>
 #include <time.h>
 #include <tlhelp32.h>  
+#include <libdeflate.h>
 #include <zip.h>
 #include <zipconf.h>
+#include <zlib.h>
+#if defined(_M_X64) || defined(_M_IX86)
+#include <intrin.h>         // __cpuid, PCLMULQDQ for Crc32Update
+#endif
 //#include <curl.h>         // Use this if we want to make web service calls
 
 #pragma comment(lib, "comctl32.lib")
@@ -63,28 +105,66 @@
 #pragma comment(lib, "pathcch.lib")
 #pragma comment(lib, "Shlwapi.lib")
 #pragma comment(lib, "libzip-static.lib")
+#pragma comment(lib, "deflatestatic.lib")
 
 #define IDC_LISTVIEW 101
 #define IDC_EXIT_BUTTON 102
 #define IDC_COPY_BUTTON 103
 #define IDC_PROGRESS_BAR 104
 
-const wchar_t* PROGRAMDIR = L"c:\\Dev\\Test\\";       // For testing
+// Posted by the install thread to the window
+#define WM_INSTALLDONE (WM_APP + 1)     // wParam: RunInstall result
+#define WM_PROGRESS (WM_APP + 2)        // wParam: percent or PROGRESSHIDE
+
+wchar_t PROGRAMDIR[MAX_PATH] = L"c:\\Dev\\Test\\";   // For testing
+wchar_t APPDATA[MAX_PATH] = { 0 };  // Instead of %LocalAppData% if set
+wchar_t STATSFILE[MAX_PATH] = { 0 };    // JSON summary of the run
+wchar_t TRACEFILE[MAX_PATH] = { 0 };    // Chrome trace of the run
+wchar_t LOGFILE[MAX_PATH] = { 0 };      // The log as text, at the end
 static BOOL DEBUG = FALSE;
 static BOOL GOODTOLAUNCH = FALSE;
+static BOOL BENCHMARK = FALSE;
+static BOOL STREAMINSTALL = TRUE;   // Extract while the zip is downloading
+static BOOL DELTAINSTALL = FALSE;   // Link unchanged files, not extract
+static BOOL USECACHE = TRUE;        // Keep zips and skip unchanged downloads
+static BOOL VERIFYCACHE = FALSE;    // Also check the CRC of cached zips
+static BOOL MAPARCHIVE = FALSE;     // Read local zips through a mapping
+static BOOL PUBLISH = FALSE;        // Write the release index, no install
+static BOOL BATCH = FALSE;          // Several applications in one run
+static BOOL HEADLESS = FALSE;       // No window: JSON lines on stdout
+static BOOL TRACING = FALSE;        // Record spans for --stats / --trace
+static int EXTRACTTHREADS = 0;      // 0 = one per logical processor
+static int RECOMPRESS = -1;         // Publish: ZIP_CM_* for a new zip
+#define BADMETHOD -2                // RECOMPRESS named no method we know
+
+// ProcessInstall results other than 0 (installed) and -1 (failed)
+#define INSTALL_RUNNING 1
+#define INSTALL_NOTFOUND -2
+#define INSTALL_NOAPP -3
+#define INSTALL_CANCELLED -4
+
+// Exit codes of a headless run
+#define EXIT_FAILED 1
+#define EXIT_USAGE 2
+#define EXIT_RUNNING 3
+#define EXIT_NOTFOUND 4
+#define EXIT_CANCELLED 5
 
 // Function declarations
 LRESULT CALLBACK WindowProc(HWND hwnd, UINT uMsg, WPARAM wParam, LPARAM lParam);
 LRESULT CALLBACK ListViewProc(HWND hwnd, UINT uMsg, WPARAM wParam, 
         LPARAM lParam);
 
+static HWND hwndMain;
 static HWND hwndProgressBar;
 WNDPROC wpOrigListViewProc;
 HWND hListView;
 HWND hExitButton;
 HWND hCopyButton;
 wchar_t exeFileName[MAX_PATH] = { 0 };
-int msgIndex = 0;
+static HANDLE hInstallThread = NULL;    // While an install is running
+static BOOL closeWhenDone = FALSE;
+static volatile LONG cancelInstall = 0;
 
 void AddControls(HWND hwnd);
 
@@ -102,51 +182,886 @@ typedef struct {
     unsigned short filename_length;
     unsigned short extra_length;
 } local_file_header;
+
+typedef struct {
+    unsigned int signature;
+    unsigned short version_made;
+    unsigned short version;
+    unsigned short bit_flag;
+    unsigned short compression;
+    unsigned short mod_time;
+    unsigned short mod_date;
+    unsigned int crc32;
+    unsigned int compressed_size;
+    unsigned int uncompressed_size;
+    unsigned short filename_length;
+    unsigned short extra_length;
+    unsigned short comment_length;
+    unsigned short disk_start;
+    unsigned short internal_attributes;
+    unsigned int external_attributes;
+    unsigned int local_header_offset;
+} central_file_header;
+
+typedef struct {
+    unsigned int signature;
+    unsigned short disk;
+    unsigned short cd_disk;
+    unsigned short disk_entries;
+    unsigned short total_entries;
+    unsigned int cd_size;
+    unsigned int cd_offset;
+    unsigned short comment_length;
+} end_of_central_dir;
+
+typedef struct {
+    unsigned int signature;
+    unsigned int cd_disk;
+    unsigned long long eocd64_offset;
+    unsigned int total_disks;
+} zip64_locator;
+
+typedef struct {
+    unsigned int signature;
+    unsigned long long record_size;
+    unsigned short version_made;
+    unsigned short version;
+    unsigned int disk;
+    unsigned int cd_disk;
+    unsigned long long disk_entries;
+    unsigned long long total_entries;
+    unsigned long long cd_size;
+    unsigned long long cd_offset;
+} zip64_end_of_central_dir;
 #pragma pack(pop)
 
+#define LOCALHEADERSIG 0x04034b50
+#define CENTRALHEADERSIG 0x02014b50
+#define EOCDSIG 0x06054b50
+#define ZIP64LOCATORSIG 0x07064b50
+#define ZIP64EOCDSIG 0x06064b50
+#define ZIP64EXTRAID 0x0001
+#define UNICODEPATHID 0x7075            // Info-ZIP: UTF-8 copy of the name
+#define UTF8NAMEFLAG 0x0800             // General purpose bit 11
+
 typedef struct {
     HWND hwnd;
     wchar_t src[MAX_PATH];
     wchar_t dst[MAX_PATH];
 } COPYFILEPARAMS;
 
+// Progress of an interrupted download, kept next to the partial file as 
+// <file>.ckpt. If the server file still has the same size and time, the 
+// next attempt carries on from bytesDone. Data is flushed to disk before 
+// a checkpoint that covers it is written.
+typedef struct {
+    unsigned int signature;
+    wchar_t source[MAX_PATH];
+    ULONGLONG remoteSize;
+    ULONGLONG remoteTime;
+    ULONGLONG bytesDone;        // [0, bytesDone) is on disk
+    ULONGLONG tailStart;        // Streaming only: so is [tailStart, size)
+} CHECKPOINT;
+
+#define CHECKPOINTSIG 0x54504b43                // "CKPT"
+#define CHECKPOINTINTERVAL (32 * 1024 * 1024)
+
+// A zip being pulled from the server into a local file by a background
+// thread. The tail (central directory) is fetched first so the archive can
+// be opened right away; the rest arrives front to back and readers block
+// until the bytes they need are in.
+typedef struct {
+    wchar_t src[MAX_PATH];
+    wchar_t dst[MAX_PATH];
+    HANDLE hThread;
+    zip_uint64_t size;
+    zip_uint64_t head;          // [0, head) has arrived
+    zip_uint64_t tailStart;     // [tailStart, size) has arrived if tailDone
+    BOOL tailDone;
+    BOOL done;
+    BOOL failed;
+    volatile LONG cancel;
+    wchar_t ckptPath[MAX_PATH];
+    CHECKPOINT ckpt;
+    zip_uint64_t checkpointed;  // bytesDone of the last checkpoint
+    SRWLOCK lock;
+    CONDITION_VARIABLE arrived;
+} STREAMFILE;
+
+// One libzip source over a STREAMFILE. Each archive handle needs its own.
+typedef struct {
+    STREAMFILE* stream;
+    HANDLE hFile;
+    zip_uint64_t offset;
+    zip_error_t error;
+} STREAMREADER;
+
+typedef struct {
+    zip_uint64_t index;
+    zip_uint64_t size;
+    zip_uint64_t compSize;
+    zip_uint32_t crc;
+    zip_uint16_t method;        // ZIP_CM_*
+    BOOL hasCrc;
+    const char* name;           // Valid while the archive is indexed
+    zip_uint64_t offset;        // Of the local header, or NOOFFSET
+} EXTRACTENTRY;
+#define NOOFFSET ((zip_uint64_t)-1)
+
+// The central directory of a local zip, read in place through a mapping
+// of the end of the file (or the archive's own mapping). Nothing is 
+// allocated per entry; NextZipEntry walks it.
+typedef struct {
+    HANDLE hFile;
+    HANDLE hMapping;
+    const BYTE* view;           // Ours if hMapping is set
+    ULONGLONG viewStart;        // File offset of view[0]
+    ULONGLONG fileSize;         // The view always runs to the end
+    const BYTE* cd;
+    ULONGLONG cdStart;
+    ULONGLONG cdSize;
+    ULONGLONG count;
+} ZIPDIR;
+
+// One central directory record. The name points into the mapping and 
+// isn't terminated.
+typedef struct {
+    const char* name;
+    unsigned short nameLength;
+    BOOL utf8;                  // Else the name is in code page 437
+    unsigned short method;
+    unsigned short flags;
+    unsigned int crc;
+    ULONGLONG compSize;
+    ULONGLONG size;
+    ULONGLONG offset;           // Of the local header
+} ZIPDIRENTRY;
+
+// A local zip and how to read it: from the file, from a stream that is 
+// still arriving, or from a read-only mapping of the whole file that every
+// archive handle shares. The central directory is parsed once, by 
+// IndexArchive, and every install phase works from that index.
+typedef struct {
+    wchar_t path[MAX_PATH];
+    STREAMFILE* stream;
+    HANDLE hMapping;
+    const BYTE* view;
+    zip_uint64_t size;          // Of the file, once mapped
+    DWORD granularity;          // For views, set by OpenStoredSource
+    zip_t* z;                   // Kept for the extracting thread
+    EXTRACTENTRY* entries;      // In central directory order
+    char* names;                // Entry names, when read by ReadZipDir
+    LONG count;
+    BOOL incomplete;            // Some entries couldn't be read
+    BOOL damaged;               // Some entries failed the CRC check
+    BOOL unreadable;            // Some entries use a method we lack
+    wchar_t exeName[MAX_PATH];  // Entry point, relative, or empty
+} ARCHIVE;
+
+// Shared state for the extraction workers. Entries are handed out from the
+// front of the (size sorted) array through an interlocked counter.
+typedef struct {
+    const ARCHIVE* archive;
+    const wchar_t* outdir;
+    const wchar_t* basedir;     // Delta: unchanged files are linked from
+    EXTRACTENTRY* entries;
+    LONG count;
+    volatile LONG next;
+    volatile LONG errors;
+    volatile LONG unchanged;
+    volatile LONG corrupt;      // Entries whose CRC or size was wrong
+} EXTRACTJOB;
+
+// What an extraction thread inflates with: a libdeflate decompressor and
+// buffers for a whole entry, kept for the next one. See InflateEntry.
+typedef struct {
+    struct libdeflate_decompressor* decompressor;
+    BYTE* in;
+    size_t inSize;
+    BYTE* out;
+    size_t outSize;
+} INFLATER;
+
+// Top level files and directories of retired installs, deleted in 
+// parallel by ReclaimRetired
+typedef struct {
+    wchar_t (*paths)[MAX_PATH];
+    LONG count;
+    volatile LONG next;
+} DELETEJOB;
+
+// Applications to install in batch mode, handed out to the install 
+// threads through an interlocked counter
+#define MAXBATCH 64
+typedef struct {
+    HWND hwnd;
+    wchar_t apps[MAXBATCH][MAX_PATH];
+    LONG count;
+    volatile LONG next;
+    volatile LONG failed;
+} BATCHJOB;
+
+// One log line (or, headless, event) on its way to the sink. See PushLog.
+#define LOGTEXT 384
+typedef struct {
+    volatile LONG sequence;
+    FILETIME time;
+    LARGE_INTEGER ticks;
+    BOOL isEvent;               // text is JSON fields, type the event name
+    wchar_t type[16];
+    wchar_t text[LOGTEXT];
+} LOGRECORD;
+
+// One line of the log once it has been drained. The text is kept end to
+// end with the rest in one buffer. See StoreLogRecord.
+typedef struct {
+    FILETIME time;
+    DWORD text;                 // Offset into logText
+    WORD length;                // Characters, without the terminator
+    WORD type;                  // Index into logTypes
+} LOGENTRY;
+
+// A timed install step or call, for --stats and --trace
+typedef struct {
+    const wchar_t* category;    // "step" or "call"
+    const wchar_t* name;        // A literal
+    wchar_t detail[MAX_PATH];   // What it worked on
+    DWORD thread;
+    LONGLONG start;             // Performance counter ticks
+    LONGLONG end;
+    ULONGLONG bytes;
+    LONG count;                 // Entries or files
+    BOOL ok;
+} SPAN;
+
+// A directory the archive needs, as a prefix of an entry name
+typedef struct {
+    const char* name;           // '/' separated, not terminated
+    int len;
+    int depth;
+} EXTRACTDIR;
+
+// Directories to create before extraction, shallowest first
+typedef struct {
+    const wchar_t* outdir;
+    EXTRACTDIR* dirs;
+    LONG count;
+    volatile LONG next;
+    volatile LONG calls;        // Filesystem calls made
+    volatile LONG errors;
+} DIRJOB;
+
 //============================================================================
-// Add an output line to the list view with columns for time, type and message
-static void AddMessage(wchar_t* textType, wchar_t* text) {
-    LVITEM lvi = { 0 };
-    lvi.mask = LVIF_TEXT;
-    lvi.iItem = msgIndex;
-    msgIndex++;
-
-    // -----------------------------------------------------------------------
-    // Get the current time
-    time_t t = time(NULL);
-    struct tm* tmInfo = localtime(&t);
+// Progress bar updates from the install threads. They are posted, so an 
+// install never waits on the UI; WindowProc applies them.
+
+#define PROGRESSHIDE ((WPARAM)-1)
+#define PROGRESSINTERVAL 250            // Milliseconds between updates
+
+static void ShowProgress(int percent) {
+    if (hwndMain != NULL)
+        PostMessage(hwndMain, WM_PROGRESS, (WPARAM)percent, 0);
+}
+
+static void HideProgress(void) {
+    if (hwndMain != NULL)
+        PostMessage(hwndMain, WM_PROGRESS, PROGRESSHIDE, 0);
+}
+
+// At most a few updates a second, however small the steps
+static void ReportProgress(ULONGLONG done, ULONGLONG total, 
+        ULONGLONG* lastTick) {
+    ULONGLONG now = GetTickCount64();
+    if (now - *lastTick < PROGRESSINTERVAL && done < total) {
+        return;
+    }
+    *lastTick = now;
+    // An empty file is done as soon as it is opened
+    ShowProgress(total > 0 ? (int)(done * 100 / total) : 100);
+}
+
+//============================================================================
+
+static double ElapsedSeconds(const LARGE_INTEGER* start) {
+    LARGE_INTEGER now, freq;
+    QueryPerformanceCounter(&now);
+    QueryPerformanceFrequency(&freq);
+    return (double)(now.QuadPart - start->QuadPart) / (double)freq.QuadPart;
+}
+
+//============================================================================
+// Log pipeline. AddMessage only copies the line into a slot of a lock-free
+// ring and returns; nothing on the install path formats times, touches a 
+// window or dispatches messages. DrainLog empties the ring in batches into
+// the sink: the list view (on a UI timer) or, headless, stdout (from a 
+// drain thread).
+//
+// The ring is a bounded multi-producer queue: a producer claims slot pos 
+// when its sequence equals pos, fills it and publishes it by setting the 
+// sequence to pos + 1. The drain hands it back as pos + LOGSLOTS. If the 
+// ring stays full for LOGFULLWAIT ms the line is dropped and counted.
+//
+// Headless, every line is a JSON object with "event" and "time" (seconds 
+// since the run started):
+//     {"event":"log","time":0.012,"level":"INFO","text":"..."}
+//     {"event":"step","time":1.532,"app":"..","step":"extract","ok":true,
+//         "seconds":1.204,"bytes":73400320}
+//     {"event":"end","time":2.101,"exit":0}
+
+#define LOGSLOTS 4096               // Power of two
+#define LOGDRAININTERVAL 50         // Milliseconds between drains
+#define LOGFULLWAIT 200             // Milliseconds before dropping a line
+#define IDT_LOGDRAIN 1
+#define EVENTLINE (3 * LOGTEXT)
+#define SINKBUFFER (64 * 1024)
+
+static LOGRECORD logRing[LOGSLOTS];
+static volatile LONG logHead = 0;   // Next slot to claim
+static LONG logTail = 0;            // Next slot to drain
+static volatile LONG logDropped = 0;
+static SRWLOCK logDrainLock = SRWLOCK_INIT;
+static DWORD logOwner = 0;          // Thread that owns the list view
+
+static HANDLE hEventOut = NULL;
+static HANDLE hDrainThread = NULL;
+static HANDLE hDrainStop = NULL;
+static LARGE_INTEGER runStart;
+static char sinkBuffer[SINKBUFFER];
+static int sinkUsed = 0;
+
+// Drained log lines, behind the virtual list view and the exports
+#define LOGTYPES 16
+static LOGENTRY* logEntries = NULL;
+static LONG logCount = 0;
+static LONG logCapacity = 0;
+static wchar_t* logText = NULL;
+static size_t logTextUsed = 0;
+static size_t logTextCapacity = 0;
+static wchar_t logTypes[LOGTYPES][16];
+static WORD logTypeCount = 0;
+static LONG logShown = 0;           // Rows the list view knows about
+
+static void InitLog(void) {
+    for (LONG i = 0; i < LOGSLOTS; i++)
+        logRing[i].sequence = i;
+    logOwner = GetCurrentThreadId();
+    QueryPerformanceCounter(&runStart);
+}
+
+static BOOL TryPushLog(BOOL isEvent, const wchar_t* type, 
+        const wchar_t* text) {
+    LOGRECORD* rec;
+    LONG pos = logHead;
+    for (;;) {
+        rec = &logRing[pos & (LOGSLOTS - 1)];
+        LONG diff = rec->sequence - pos;
+        if (diff == 0) {
+            LONG seen = InterlockedCompareExchange(&logHead, pos + 1, pos);
+            if (seen == pos)
+                break;
+            pos = seen;
+        } else if (diff < 0) {
+            return FALSE;           // Full: the drain hasn't got here yet
+        } else {
+            pos = logHead;          // Another producer took it
+        }
+    }
+    GetSystemTimeAsFileTime(&rec->time);
+    QueryPerformanceCounter(&rec->ticks);
+    rec->isEvent = isEvent;
+    wcsncpy_s(rec->type, 16, type, _TRUNCATE);
+    wcsncpy_s(rec->text, LOGTEXT, text, _TRUNCATE);
+    InterlockedExchange(&rec->sequence, pos + 1);
+    return TRUE;
+}
+
+static void DrainLog(void);
+
+static void PushLog(BOOL isEvent, const wchar_t* type, const wchar_t* text) {
+    int waited = 0;
+    while (!TryPushLog(isEvent, type, text)) {
+        if (HEADLESS == FALSE && GetCurrentThreadId() == logOwner) {
+            DrainLog();             // We are the sink: make room
+        } else if (waited++ < LOGFULLWAIT) {
+            Sleep(1);
+        } else {
+            InterlockedIncrement(&logDropped);
+            return;
+        }
+    }
+}
+
+// text as a quoted JSON string, truncated to fit
+static void JsonString(wchar_t* out, size_t size, const wchar_t* text) {
+    size_t j = 0;
+    out[j++] = L'"';
+    for (; *text != L'\0' && j + 8 < size; text++) {
+        if (*text == L'"' || *text == L'\\') {
+            out[j++] = L'\\';
+            out[j++] = *text;
+        } else if (*text < 0x20) {
+            StringCchPrintf(out + j, size - j, L"\\u%04x", *text);
+            j += 6;
+        } else {
+            out[j++] = *text;
+        }
+    }
+    out[j++] = L'"';
+    out[j] = L'\0';
+}
+
+static void FlushSink(void) {
+    DWORD written = 0;
+    if (sinkUsed > 0 && hEventOut != NULL && 
+            hEventOut != INVALID_HANDLE_VALUE) {
+        WriteFile(hEventOut, sinkBuffer, sinkUsed, &written, NULL);
+    }
+    sinkUsed = 0;
+}
+
+// Headless sink: the record as one JSON line, buffered
+static void WriteLogRecord(const LOGRECORD* rec) {
+    wchar_t line[EVENTLINE + 64];
+    wchar_t level[32];
+    wchar_t quoted[2 * LOGTEXT];
+    double seconds = 0.0;
+    LARGE_INTEGER freq;
+    QueryPerformanceFrequency(&freq);
+    seconds = (double)(rec->ticks.QuadPart - runStart.QuadPart) / 
+        (double)freq.QuadPart;
+
+    if (rec->isEvent) {
+        StringCchPrintf(line, EVENTLINE + 64, 
+            L"{\"event\":\"%s\",\"time\":%.3f%s%s}\n", rec->type, seconds, 
+            rec->text[0] ? L"," : L"", rec->text);
+    } else {
+        JsonString(level, 32, rec->type);
+        JsonString(quoted, 2 * LOGTEXT, rec->text);
+        StringCchPrintf(line, EVENTLINE + 64, 
+            L"{\"event\":\"log\",\"time\":%.3f,\"level\":%s,\"text\":%s}\n",
+            seconds, level, quoted);
+    }
+    if (sinkUsed + 3 * (EVENTLINE + 64) > SINKBUFFER)
+        FlushSink();
+    int len = WideCharToMultiByte(CP_UTF8, 0, line, -1, 
+        sinkBuffer + sinkUsed, SINKBUFFER - sinkUsed, NULL, NULL);
+    if (len > 1)
+        sinkUsed += len - 1;
+}
+
+static void FormatLogTime(const FILETIME* time, wchar_t* out, size_t size) {
+    FILETIME local;
+    SYSTEMTIME st;
+    FileTimeToLocalFileTime(time, &local);
+    FileTimeToSystemTime(&local, &st);
+    StringCchPrintf(out, size, L"%02d:%02d:%02d", st.wHour, st.wMinute,
+        st.wSecond);
+}
+
+static WORD LogTypeIndex(const wchar_t* type) {
+    for (WORD i = 0; i < logTypeCount; i++) {
+        if (wcscmp(logTypes[i], type) == 0)
+            return i;
+    }
+    if (logTypeCount == LOGTYPES)
+        return LOGTYPES - 1;        // More than anyone logs: they share
+    wcscpy_s(logTypes[logTypeCount], 16, type);
+    return logTypeCount++;
+}
+
+// Window sink: the record joins the store. The list view asks for rows
+// as it paints them (LVN_GETDISPINFO), so it holds no text of its own.
+static BOOL StoreLogRecord(const LOGRECORD* rec) {
+    size_t length = wcslen(rec->text);
+    if (logCount == logCapacity) {
+        LONG capacity = logCapacity > 0 ? 2 * logCapacity : 1024;
+        LOGENTRY* entries = (LOGENTRY*)realloc(logEntries, 
+            capacity * sizeof(LOGENTRY));
+        if (entries == NULL)
+            return FALSE;
+        logEntries = entries;
+        logCapacity = capacity;
+    }
+    if (logTextUsed + length + 1 > logTextCapacity) {
+        size_t capacity = max(2 * logTextCapacity, 64 * 1024);
+        wchar_t* text = (wchar_t*)realloc(logText, 
+            capacity * sizeof(wchar_t));
+        if (text == NULL)
+            return FALSE;
+        logText = text;
+        logTextCapacity = capacity;
+    }
+    LOGENTRY* entry = &logEntries[logCount++];
+    entry->time = rec->time;
+    entry->text = (DWORD)logTextUsed;
+    entry->length = (WORD)length;
+    entry->type = LogTypeIndex(rec->type);
+    memcpy(logText + logTextUsed, rec->text, (length + 1) * sizeof(wchar_t));
+    logTextUsed += length + 1;
+    return TRUE;
+}
+
+// Row and column of the list view, from the store
+static void GetLogDispInfo(LVITEM* item) {
+    if (!(item->mask & LVIF_TEXT) || item->iItem < 0 || 
+            item->iItem >= logCount)
+        return;
+    const LOGENTRY* entry = &logEntries[item->iItem];
+    if (item->iSubItem == 2) {
+        item->pszText = logText + entry->text;
+    } else if (item->cchTextMax > 0 && item->iSubItem == 1) {
+        wcsncpy_s(item->pszText, item->cchTextMax, logTypes[entry->type],
+            _TRUNCATE);
+    } else if (item->cchTextMax > 0) {
+        FormatLogTime(&entry->time, item->pszText, item->cchTextMax);
+    }
+}
+
+// Characters in the stored log as text: HH:MM:SS, type and message, 
+// tab separated, one line each
+static size_t LogTextLength(void) {
+    size_t typeLength[LOGTYPES];
+    size_t length = 0;
+    for (WORD i = 0; i < logTypeCount; i++)
+        typeLength[i] = wcslen(logTypes[i]);
+    for (LONG i = 0; i < logCount; i++)
+        length += 8 + 1 + typeLength[logEntries[i].type] + 1 + 
+            logEntries[i].length + 2;
+    return length;
+}
+
+// The log as text into out, which holds LogTextLength() + 1 characters.
+// Every piece is copied to where it goes, so this is linear in the log.
+static void FormatLogText(wchar_t* out) {
     wchar_t timeString[9]; // HH:MM:SS
-    wcsftime(timeString, 9, L"%H:%M:%S", tmInfo);
-
-    // Set the time in the first column
-    lvi.iSubItem = 0; // First column
-    lvi.pszText = timeString;
-    ListView_InsertItem(hListView, &lvi);
-
-    // -----------------------------------------------------------------------
-    // Set the provided textType in the second column
-    lvi.iSubItem = 1; // Second column
-    lvi.pszText = textType;
-    ListView_SetItem(hListView, &lvi);
-
-    // -----------------------------------------------------------------------
-    // Set the provided text in the third column
-    lvi.iSubItem = 2; // Third column
-    lvi.pszText = text;
-    ListView_SetItem(hListView, &lvi);
-
-    // Process pending messages to keep the UI responsive
-    MSG msg;
-    while (PeekMessage(&msg, NULL, 0, 0, PM_REMOVE)) {
-        TranslateMessage(&msg);
-        DispatchMessage(&msg);
+    for (LONG i = 0; i < logCount; i++) {
+        const LOGENTRY* entry = &logEntries[i];
+        size_t typeLength = wcslen(logTypes[entry->type]);
+        FormatLogTime(&entry->time, timeString, 9);
+        memcpy(out, timeString, 8 * sizeof(wchar_t));
+        out += 8;
+        *out++ = L'\t';
+        memcpy(out, logTypes[entry->type], typeLength * sizeof(wchar_t));
+        out += typeLength;
+        *out++ = L'\t';
+        memcpy(out, logText + entry->text, entry->length * sizeof(wchar_t));
+        out += entry->length;
+        *out++ = L'\r';
+        *out++ = L'\n';
+    }
+    *out = L'\0';
+}
+
+// --log: the stored log as UTF-8 text
+static BOOL WriteLogFile(const wchar_t* path) {
+    BOOL ok = FALSE;
+    size_t length = LogTextLength();
+    wchar_t* text = (wchar_t*)malloc((length + 1) * sizeof(wchar_t));
+    if (text == NULL)
+        return FALSE;
+    FormatLogText(text);
+    int size = WideCharToMultiByte(CP_UTF8, 0, text, (int)length, NULL, 0,
+        NULL, NULL);
+    char* utf8 = (char*)malloc(max(size, 1));
+    if (utf8 != NULL) {
+        WideCharToMultiByte(CP_UTF8, 0, text, (int)length, utf8, size, 
+            NULL, NULL);
+        FILE* f = _wfopen(path, L"wb");
+        if (f != NULL) {
+            ok = fwrite(utf8, 1, size, f) == (size_t)size;
+            ok = fclose(f) == 0 && ok;
+        }
+    }
+    free(utf8);
+    free(text);
+    return ok;
+}
+
+static void SinkRecord(LOGRECORD* rec) {
+    if (!rec->isEvent && (HEADLESS == FALSE || wcslen(LOGFILE) > 0))
+        StoreLogRecord(rec);
+    if (HEADLESS == TRUE)
+        WriteLogRecord(rec);
+}
+
+// Everything published so far goes to the sink. One drain at a time.
+static void DrainLog(void) {
+    AcquireSRWLockExclusive(&logDrainLock);
+    for (;;) {
+        LOGRECORD* rec = &logRing[logTail & (LOGSLOTS - 1)];
+        if (rec->sequence != logTail + 1)
+            break;                  // Not published yet
+        SinkRecord(rec);
+        InterlockedExchange(&rec->sequence, logTail + LOGSLOTS);
+        logTail++;
+    }
+    LONG dropped = InterlockedExchange(&logDropped, 0);
+    if (dropped > 0) {
+        LOGRECORD note = { 0 };
+        GetSystemTimeAsFileTime(&note.time);
+        QueryPerformanceCounter(&note.ticks);
+        wcscpy_s(note.type, 16, L"ERROR");
+        StringCchPrintf(note.text, LOGTEXT, 
+            L"Log full: %ld messages dropped", dropped);
+        SinkRecord(&note);
+    }
+    if (HEADLESS == TRUE) {
+        FlushSink();
+    } else if (hListView != NULL && logShown != logCount) {
+        // Only the new rows are painted, once for the batch
+        ListView_SetItemCountEx(hListView, logCount, 
+            LVSICF_NOINVALIDATEALL | LVSICF_NOSCROLL);
+        logShown = logCount;
+    }
+    ReleaseSRWLockExclusive(&logDrainLock);
+}
+
+static DWORD WINAPI LogDrainProc(LPVOID lpParam) {
+    while (WaitForSingleObject(hDrainStop, LOGDRAININTERVAL) == WAIT_TIMEOUT)
+        DrainLog();
+    return 0;
+}
+
+// Headless: stdout, and a thread to drain the log into it
+static void OpenEventStream(void) {
+    hEventOut = GetStdHandle(STD_OUTPUT_HANDLE);
+    // A GUI program only has a stdout when it has been redirected
+    if ((hEventOut == NULL || hEventOut == INVALID_HANDLE_VALUE) && 
+            AttachConsole(ATTACH_PARENT_PROCESS)) {
+        hEventOut = CreateFile(L"CONOUT$", GENERIC_WRITE, FILE_SHARE_WRITE,
+            NULL, OPEN_EXISTING, 0, NULL);
+    }
+    hDrainStop = CreateEvent(NULL, TRUE, FALSE, NULL);
+    if (hDrainStop != NULL)
+        hDrainThread = CreateThread(NULL, 0, LogDrainProc, NULL, 0, NULL);
+}
+
+static void CloseEventStream(void) {
+    if (hDrainThread != NULL) {
+        SetEvent(hDrainStop);
+        WaitForSingleObject(hDrainThread, INFINITE);
+        CloseHandle(hDrainThread);
+        hDrainThread = NULL;
+    }
+    if (hDrainStop != NULL)
+        CloseHandle(hDrainStop);
+    DrainLog();
+}
+
+// fields are the rest of the object, already in JSON, without braces
+static void EmitEvent(const wchar_t* event, const wchar_t* fields) {
+    if (HEADLESS == TRUE)
+        PushLog(TRUE, event, fields);
+}
+
+//============================================================================
+// Log a line with a type (INFO, ERROR, ...). Safe from any thread.
+static void AddMessage(wchar_t* textType, wchar_t* text) {
+    PushLog(FALSE, textType, text);
+}
+
+//============================================================================
+// Instrumentation. Each install step (LogStep) and each call to the 
+// expensive functions is recorded as a span: what ran, on which thread, 
+// when, and how many bytes and files it handled. At the end of the run 
+// --stats writes a summary per step and function, with MB/s, and --trace 
+// writes every span in Chrome trace format (chrome://tracing, Perfetto).
+// Recording is a slot claimed with one interlocked add; nothing is written
+// until every thread is done.
+
+#define MAXSPANS 4096
+
+static SPAN spans[MAXSPANS];
+static volatile LONG spanCount = 0;
+
+// Run totals
+static volatile LONG64 bytesCopied = 0;
+static volatile LONG64 bytesExtracted = 0;
+static volatile LONG filesCreated = 0;
+static volatile LONG filesLinked = 0;
+static volatile LONG filesDeleted = 0;
+static volatile LONG64 bytesVerified = 0;   // CRC checked as extracted
+static volatile LONG crcFailures = 0;
+static volatile LONG filesInflated = 0;     // In one call, by libdeflate
+static volatile LONG filesStored = 0;       // Written from the zip's mapping
+static volatile LONG copiesOffloaded = 0;   // Done by CopyFileEx
+
+static void RecordSpan(const wchar_t* category, const wchar_t* name, 
+        const wchar_t* detail, const LARGE_INTEGER* start, BOOL ok, 
+        ULONGLONG bytes, LONG count) {
+    LARGE_INTEGER now;
+    if (TRACING == FALSE)
+        return;
+    QueryPerformanceCounter(&now);
+    LONG i = InterlockedIncrement(&spanCount) - 1;
+    if (i >= MAXSPANS)
+        return;                     // Counted, so the summary can say so
+    SPAN* span = &spans[i];
+    span->category = category;
+    span->name = name;
+    wcsncpy_s(span->detail, MAX_PATH, detail != NULL ? detail : L"", 
+        _TRUNCATE);
+    span->thread = GetCurrentThreadId();
+    span->start = start->QuadPart;
+    span->end = now.QuadPart;
+    span->bytes = bytes;
+    span->count = count;
+    span->ok = ok;
+}
+
+static void TraceCall(const wchar_t* name, const wchar_t* detail, 
+        const LARGE_INTEGER* start, BOOL ok, ULONGLONG bytes, LONG count) {
+    RecordSpan(L"call", name, detail, start, ok, bytes, count);
+}
+
+// Output files are UTF-8 without a byte order mark
+static void WriteUtf8(FILE* f, const wchar_t* text) {
+    char utf8[4 * MAX_PATH];
+    int len = WideCharToMultiByte(CP_UTF8, 0, text, -1, utf8, sizeof(utf8),
+        NULL, NULL);
+    if (len > 1)
+        fwrite(utf8, 1, len - 1, f);
+}
+
+static double TicksToSeconds(LONGLONG ticks) {
+    LARGE_INTEGER freq;
+    QueryPerformanceFrequency(&freq);
+    return (double)ticks / (double)freq.QuadPart;
+}
+
+// Names are literals from several call sites, which the compiler needn't
+// pool, so they are compared by content
+static BOOL SameSpan(const SPAN* a, const SPAN* b) {
+    return wcscmp(a->name, b->name) == 0 && 
+        wcscmp(a->category, b->category) == 0;
+}
+
+// Totals per step and per function, in the order they first ran
+static void WriteStats(const wchar_t* path) {
+    wchar_t line[2 * MAX_PATH];
+    LONG recorded = min(spanCount, MAXSPANS);
+    LARGE_INTEGER now;
+    FILE* f = _wfopen(path, L"wb");
+    if (f == NULL) {
+        AddMessage(L"ERROR", L"Cannot write the stats file");
+        return;
+    }
+    QueryPerformanceCounter(&now);
+    StringCchPrintf(line, 2 * MAX_PATH, 
+        L"{\n  \"seconds\": %.3f,\n  \"spans\": %ld,\n"
+        L"  \"spansDropped\": %ld,\n", 
+        TicksToSeconds(now.QuadPart - runStart.QuadPart), recorded, 
+        spanCount - recorded);
+    WriteUtf8(f, line);
+    StringCchPrintf(line, 2 * MAX_PATH, 
+        L"  \"totals\": {\"bytesCopied\": %lld, \"bytesExtracted\": %lld, "
+        L"\"filesCreated\": %ld, \"filesLinked\": %ld, "
+        L"\"filesDeleted\": %ld, \"bytesVerified\": %lld, "
+        L"\"crcFailures\": %ld, \"filesInflated\": %ld, "
+        L"\"filesStored\": %ld, \"copiesOffloaded\": %ld},\n"
+        L"  \"phases\": [", 
+        bytesCopied, bytesExtracted, filesCreated, filesLinked, 
+        filesDeleted, bytesVerified, crcFailures, filesInflated, 
+        filesStored, copiesOffloaded);
+    WriteUtf8(f, line);
+
+    BOOL first = TRUE;
+    for (LONG i = 0; i < recorded; i++) {
+        LONG calls = 0, failed = 0, count = 0;
+        ULONGLONG bytes = 0;
+        LONGLONG ticks = 0, longest = 0;
+        BOOL seen = FALSE;
+        for (LONG j = 0; j < i && !seen; j++) {
+            seen = SameSpan(&spans[j], &spans[i]);
+        }
+        if (seen)
+            continue;
+        for (LONG j = i; j < recorded; j++) {
+            if (!SameSpan(&spans[j], &spans[i]))
+                continue;
+            LONGLONG length = spans[j].end - spans[j].start;
+            calls++;
+            failed += spans[j].ok ? 0 : 1;
+            count += spans[j].count;
+            bytes += spans[j].bytes;
+            ticks += length;
+            longest = max(longest, length);
+        }
+        double seconds = TicksToSeconds(ticks);
+        StringCchPrintf(line, 2 * MAX_PATH, 
+            L"%s\n    {\"category\": \"%s\", \"name\": \"%s\", "
+            L"\"calls\": %ld, \"failed\": %ld, \"seconds\": %.3f, "
+            L"\"longest\": %.3f, \"bytes\": %llu, \"count\": %ld, "
+            L"\"MBps\": %.1f}", 
+            first ? L"" : L",", spans[i].category, spans[i].name, calls, 
+            failed, seconds, TicksToSeconds(longest), bytes, count, 
+            seconds > 0 ? bytes / (1024.0 * 1024.0) / seconds : 0.0);
+        WriteUtf8(f, line);
+        first = FALSE;
+    }
+    WriteUtf8(f, L"\n  ]\n}\n");
+    fclose(f);
+}
+
+// Chrome trace event format: one complete ("X") event per span, in 
+// microseconds from the start of the run
+static void WriteTrace(const wchar_t* path) {
+    wchar_t line[3 * MAX_PATH];
+    wchar_t detail[2 * MAX_PATH];
+    LONG recorded = min(spanCount, MAXSPANS);
+    FILE* f = _wfopen(path, L"wb");
+    if (f == NULL) {
+        AddMessage(L"ERROR", L"Cannot write the trace file");
+        return;
+    }
+    WriteUtf8(f, L"{\"displayTimeUnit\": \"ms\", \"traceEvents\": [");
+    for (LONG i = 0; i < recorded; i++) {
+        const SPAN* span = &spans[i];
+        JsonString(detail, 2 * MAX_PATH, span->detail);
+        StringCchPrintf(line, 3 * MAX_PATH, 
+            L"%s\n{\"name\": \"%s\", \"cat\": \"%s\", \"ph\": \"X\", "
+            L"\"pid\": 1, \"tid\": %lu, \"ts\": %.1f, \"dur\": %.1f, "
+            L"\"args\": {\"detail\": %s, \"ok\": %s, \"bytes\": %llu, "
+            L"\"count\": %ld}}", 
+            i == 0 ? L"" : L",", span->name, span->category, span->thread,
+            TicksToSeconds(span->start - runStart.QuadPart) * 1e6,
+            TicksToSeconds(span->end - span->start) * 1e6, detail,
+            span->ok ? L"true" : L"false", span->bytes, span->count);
+        WriteUtf8(f, line);
+    }
+    WriteUtf8(f, L"\n]}\n");
+    fclose(f);
+}
+
+// Once every install and delete thread has finished
+static void WriteProfile(void) {
+    if (wcslen(STATSFILE) > 0)
+        WriteStats(STATSFILE);
+    if (wcslen(TRACEFILE) > 0)
+        WriteTrace(TRACEFILE);
+}
+
+//============================================================================
+// One install step for appName is over: a step event when headless, with 
+// debug detail otherwise. bytes is whatever the step moved, or 0.
+
+static void LogStep(const wchar_t* appName, const wchar_t* step, BOOL ok,
+        const LARGE_INTEGER* start, ULONGLONG bytes) {
+    wchar_t app[MAX_PATH + 10];
+    wchar_t msg[MAX_PATH + 100];
+    double seconds = ElapsedSeconds(start);
+    RecordSpan(L"step", step, appName, start, ok, bytes, 0);
+    if (HEADLESS == TRUE) {
+        JsonString(app, MAX_PATH + 10, appName);
+        StringCchPrintf(msg, MAX_PATH + 100, 
+            L"\"app\":%s,\"step\":\"%s\",\"ok\":%s,\"seconds\":%.3f,"
+            L"\"bytes\":%llu", app, step, ok ? L"true" : L"false", seconds, 
+            bytes);
+        EmitEvent(L"step", msg);
+    } else if (DEBUG == TRUE) {
+        StringCchPrintf(msg, MAX_PATH + 100, L"%s: %s %s in %.2f s, %llu bytes",
+            appName, step, ok ? L"done" : L"failed", seconds, bytes);
+        AddMessage(L"DEBUG", msg);
     }
 }
 
@@ -221,6 +1136,257 @@ static BOOL FileExists(LPCTSTR szPath)
          !(dwAttrib & FILE_ATTRIBUTE_DIRECTORY));
 }
 
+//============================================================================
+// %LocalAppData% and the Start menu programs folder. With --appdata both 
+// live under that folder instead, so a test run leaves the profile alone.
+
+static BOOL GetLocalAppData(wchar_t* appdata) {
+    if (wcslen(APPDATA) > 0) {
+        wcscpy_s(appdata, MAX_PATH, APPDATA);
+        return DirectoryExists(appdata) || CreateDirectory(appdata, NULL);
+    }
+    return SUCCEEDED(SHGetFolderPath(NULL, CSIDL_LOCAL_APPDATA, NULL, 0, 
+        appdata));
+}
+
+static BOOL GetProgramsFolder(wchar_t* programs) {
+    if (wcslen(APPDATA) > 0) {
+        StringCchPrintf(programs, MAX_PATH, L"%s\\Programs", APPDATA);
+        return TRUE;
+    }
+    return SUCCEEDED(SHGetFolderPath(NULL, CSIDL_PROGRAMS, NULL, 0, 
+        programs));
+}
+
+//============================================================================
+
+static BOOL GetFileSizeAndTime(const wchar_t* path, ULONGLONG* size,
+        ULONGLONG* time) {
+    WIN32_FILE_ATTRIBUTE_DATA info;
+    if (!GetFileAttributesEx(path, GetFileExInfoStandard, &info)) {
+        return FALSE;
+    }
+    *size = ((ULONGLONG)info.nFileSizeHigh << 32) | info.nFileSizeLow;
+    *time = ((ULONGLONG)info.ftLastWriteTime.dwHighDateTime << 32) | 
+        info.ftLastWriteTime.dwLowDateTime;
+    return TRUE;
+}
+
+//============================================================================
+// Download checkpoints: see CHECKPOINT
+
+static void FillCheckpoint(CHECKPOINT* ckpt, const wchar_t* src, 
+        ULONGLONG size, ULONGLONG time) {
+    memset(ckpt, 0, sizeof(CHECKPOINT));
+    ckpt->signature = CHECKPOINTSIG;
+    wcscpy_s(ckpt->source, MAX_PATH, src);
+    ckpt->remoteSize = size;
+    ckpt->remoteTime = time;
+}
+
+// Is there a checkpoint for partial that was taken against the same 
+// version of the source as expected?
+static BOOL ReadCheckpoint(const wchar_t* ckptPath, const wchar_t* partial,
+        const CHECKPOINT* expected, CHECKPOINT* saved) {
+    ULONGLONG partialSize, partialTime;
+    DWORD bytesRead = 0;
+    HANDLE hFile = CreateFile(ckptPath, GENERIC_READ, FILE_SHARE_READ, NULL,
+        OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (hFile == INVALID_HANDLE_VALUE) {
+        return FALSE;
+    }
+    BOOL ok = ReadFile(hFile, saved, sizeof(CHECKPOINT), &bytesRead, NULL) &&
+        bytesRead == sizeof(CHECKPOINT);
+    CloseHandle(hFile);
+
+    return ok && saved->signature == CHECKPOINTSIG &&
+        _wcsicmp(saved->source, expected->source) == 0 &&
+        saved->remoteSize == expected->remoteSize &&
+        saved->remoteTime == expected->remoteTime &&
+        saved->bytesDone <= saved->remoteSize &&
+        GetFileSizeAndTime(partial, &partialSize, &partialTime) &&
+        partialSize >= saved->bytesDone;
+}
+
+// The data it covers must already have been flushed
+static void WriteCheckpoint(const wchar_t* ckptPath, const CHECKPOINT* ckpt) {
+    DWORD written = 0;
+    HANDLE hFile = CreateFile(ckptPath, GENERIC_WRITE, 0, NULL, 
+        CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_WRITE_THROUGH, NULL);
+    if (hFile != INVALID_HANDLE_VALUE) {
+        WriteFile(hFile, ckpt, sizeof(CHECKPOINT), &written, NULL);
+        CloseHandle(hFile);
+    }
+}
+
+//============================================================================
+// CRC32 as zip and zlib define it. Where the processor has carry-less 
+// multiply (PCLMULQDQ) the data is folded 64 bytes at a time, after 
+// Intel's "Fast CRC Computation for Generic Polynomials Using PCLMULQDQ"; 
+// zlib's table driven crc32 does the tail, and everything elsewhere. 
+// SSE4.2's crc32 instruction is no use here: its polynomial is CRC-32C.
+
+#define CRCFOLDMIN 64               // Smaller runs go straight to zlib
+
+#if defined(_M_X64) || defined(_M_IX86)
+static volatile LONG crcFolding = -1;   // Not checked yet
+
+static BOOL CanFoldCrc(void) {
+    int info[4];
+    if (crcFolding < 0) {
+        __cpuid(info, 1);
+        // PCLMULQDQ, and SSE4.1 for the final extract
+        InterlockedExchange(&crcFolding, 
+            (info[2] & (1 << 1)) != 0 && (info[2] & (1 << 19)) != 0);
+    }
+    return crcFolding == 1;
+}
+
+// len is at least CRCFOLDMIN and a multiple of 16. crc is the register,
+// that is, inverted.
+static unsigned int Crc32Fold(const BYTE* buf, size_t len, unsigned int crc) {
+    // x^(4*128+32), x^(4*128-32), x^(128+32), x^(128-32), x^64 mod P(x),
+    // then P(x) and its Barrett constant, all bit reflected
+    static const __declspec(align(16)) unsigned __int64 k1k2[] = 
+        { 0x0154442bd4, 0x01c6e41596 };
+    static const __declspec(align(16)) unsigned __int64 k3k4[] = 
+        { 0x01751997d0, 0x00ccaa009e };
+    static const __declspec(align(16)) unsigned __int64 k5k0[] = 
+        { 0x0163cd6124, 0x0000000000 };
+    static const __declspec(align(16)) unsigned __int64 poly[] = 
+        { 0x01db710641, 0x01f7011641 };
+    __m128i x0, x1, x2, x3, x4, x5, x6, x7, x8;
+
+    x1 = _mm_loadu_si128((const __m128i*)(buf + 0x00));
+    x2 = _mm_loadu_si128((const __m128i*)(buf + 0x10));
+    x3 = _mm_loadu_si128((const __m128i*)(buf + 0x20));
+    x4 = _mm_loadu_si128((const __m128i*)(buf + 0x30));
+    x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128((int)crc));
+    x0 = _mm_load_si128((const __m128i*)k1k2);
+    buf += 64;
+    len -= 64;
+
+    // Four lanes of 128 bits, each folded 512 bits forward
+    while (len >= 64) {
+        x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+        x6 = _mm_clmulepi64_si128(x2, x0, 0x00);
+        x7 = _mm_clmulepi64_si128(x3, x0, 0x00);
+        x8 = _mm_clmulepi64_si128(x4, x0, 0x00);
+        x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+        x2 = _mm_clmulepi64_si128(x2, x0, 0x11);
+        x3 = _mm_clmulepi64_si128(x3, x0, 0x11);
+        x4 = _mm_clmulepi64_si128(x4, x0, 0x11);
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, x5), 
+            _mm_loadu_si128((const __m128i*)(buf + 0x00)));
+        x2 = _mm_xor_si128(_mm_xor_si128(x2, x6), 
+            _mm_loadu_si128((const __m128i*)(buf + 0x10)));
+        x3 = _mm_xor_si128(_mm_xor_si128(x3, x7), 
+            _mm_loadu_si128((const __m128i*)(buf + 0x20)));
+        x4 = _mm_xor_si128(_mm_xor_si128(x4, x8), 
+            _mm_loadu_si128((const __m128i*)(buf + 0x30)));
+        buf += 64;
+        len -= 64;
+    }
+
+    // The four lanes into one, then the rest 16 bytes at a time
+    x0 = _mm_load_si128((const __m128i*)k3k4);
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x3), x5);
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x4), x5);
+    while (len >= 16) {
+        x2 = _mm_loadu_si128((const __m128i*)buf);
+        x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+        x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+        buf += 16;
+        len -= 16;
+    }
+
+    // 128 bits to 64
+    x2 = _mm_clmulepi64_si128(x1, x0, 0x10);
+    x3 = _mm_setr_epi32(~0, 0, ~0, 0);
+    x1 = _mm_xor_si128(_mm_srli_si128(x1, 8), x2);
+    x0 = _mm_loadl_epi64((const __m128i*)k5k0);
+    x2 = _mm_srli_si128(x1, 4);
+    x1 = _mm_and_si128(x1, x3);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_xor_si128(x1, x2);
+
+    // Barrett reduction to 32
+    x0 = _mm_load_si128((const __m128i*)poly);
+    x2 = _mm_and_si128(x1, x3);
+    x2 = _mm_clmulepi64_si128(x2, x0, 0x10);
+    x2 = _mm_and_si128(x2, x3);
+    x2 = _mm_clmulepi64_si128(x2, x0, 0x00);
+    x1 = _mm_xor_si128(x1, x2);
+    return (unsigned int)_mm_extract_epi32(x1, 1);
+}
+#endif
+
+// crc32(crc, data, len), for any length
+static zip_uint32_t Crc32Update(zip_uint32_t crc, const void* data, 
+        size_t len) {
+    const BYTE* buf = (const BYTE*)data;
+#if defined(_M_X64) || defined(_M_IX86)
+    if (len >= CRCFOLDMIN && CanFoldCrc()) {
+        size_t folded = len & ~(size_t)15;
+        crc = ~Crc32Fold(buf, folded, ~crc);
+        buf += folded;
+        len -= folded;
+    }
+#endif
+    while (len > 0) {
+        uInt chunk = (uInt)min(len, 0x40000000);
+        crc = (zip_uint32_t)crc32(crc, buf, chunk);
+        buf += chunk;
+        len -= chunk;
+    }
+    return crc;
+}
+
+//============================================================================
+// CRC32 of a file on disk. Returns FALSE if the file can't be read.
+
+static BOOL FileCrc32(const wchar_t* path, zip_uint32_t* crc) {
+    FILE* f = _wfopen(path, L"rb");
+    if (f == NULL) {
+        return FALSE;
+    }
+    unsigned char buffer[65536];
+    zip_uint32_t value = 0;
+    size_t bytesRead;
+    while ((bytesRead = fread(buffer, 1, sizeof(buffer), f)) > 0) {
+        value = Crc32Update(value, buffer, bytesRead);
+    }
+    BOOL ok = !ferror(f);
+    fclose(f);
+    *crc = value;
+    return ok;
+}
+
+//============================================================================
+// Is the file on disk the same size and CRC as the archive entry?
+
+static BOOL FileMatchesEntry(const wchar_t* path, const EXTRACTENTRY* entry) {
+    WIN32_FILE_ATTRIBUTE_DATA info;
+    zip_uint32_t crc;
+    if (!entry->hasCrc || 
+            !GetFileAttributesEx(path, GetFileExInfoStandard, &info)) {
+        return FALSE;
+    }
+    if ((((zip_uint64_t)info.nFileSizeHigh << 32) | info.nFileSizeLow) != 
+            entry->size) {
+        return FALSE;
+    }
+    return FileCrc32(path, &crc) && crc == entry->crc;
+}
+
 //============================================================================
 
 // For testing progress bar
@@ -234,7 +1400,8 @@ static void Delay(int seconds)
 
 //============================================================================
 
-static void CreateDirectories(const wchar_t* path) {
+// If calls is set it is incremented for each filesystem call made
+static void CreateDirectories(const wchar_t* path, volatile LONG* calls) {
     wchar_t* tempPath = _wcsdup(path); // Duplicate path to not modify original
     if (tempPath == NULL) {
         AddMessage(L"ERROR", L"Trying to create a directory with no name");
@@ -265,9 +1432,15 @@ static void CreateDirectories(const wchar_t* path) {
         if (*currentPos == L'\\' || *currentPos == L'/') {
             *currentPos = L'\0';
             isDir = DirectoryExists(tempPath);
+            if (calls != NULL)
+                InterlockedIncrement(calls);
             if (!isDir) {
-                // Create the directory if it doesn't exist
-                if (!SUCCEEDED(_wmkdir(tempPath))) {
+                if (calls != NULL)
+                    InterlockedIncrement(calls);
+                // Create the directory if it doesn't exist. Another 
+                // extraction worker may have just created it.
+                if (!SUCCEEDED(_wmkdir(tempPath)) && 
+                        !DirectoryExists(tempPath)) {
                     continue;
                 }
             }
@@ -276,9 +1449,11 @@ static void CreateDirectories(const wchar_t* path) {
         currentPos++;
     }
     isDir = DirectoryExists(tempPath);
+    if (calls != NULL)
+        InterlockedExchangeAdd(calls, isDir ? 1 : 2);
     if (!isDir) {
         // Create the final directory if it doesn't exist
-        if (!SUCCEEDED(_wmkdir(tempPath))) {
+        if (!SUCCEEDED(_wmkdir(tempPath)) && !DirectoryExists(tempPath)) {
             AddMessage(L"ERROR", L"Unable to create directory");
         }
     }
@@ -326,7 +1501,8 @@ static void DeleteDirectoryContents(const wchar_t* path) {
             else {
                 // Delete files
                 if (wcslen(filePath) > 20 && DirDepth(filePath) > 2) {
-                    DeleteFile(filePath);
+                    if (DeleteFile(filePath))
+                        InterlockedIncrement(&filesDeleted);
                 } else {
                     wchar_t msg[MAX_PATH + 50] = { 0 };
                     wcscpy_s(msg, MAX_PATH + 50, 
@@ -394,56 +1570,959 @@ static int IsProcessRunning(const wchar_t* processName) {
 }
 
 //============================================================================
+// Streaming download: see STREAMFILE
 
-static int CheckIfRunning(wchar_t* zipPath) {
-    if (DEBUG == TRUE)
-        AddMessage(L"DEBUG", L"417 CheckIfRunning...");
-    // Find the executable name in the zip file
-    char zipfile_mb[256];
-    size_t output_size;
-    wcstombs_s(&output_size, zipfile_mb, sizeof(zipfile_mb), zipPath, 
-            sizeof(zipfile_mb));
-    int err;
-    zip_t* zip = zip_open(zipfile_mb, 0, &err);
-    if (!zip) {
-        return -1;
+#define STREAMCHUNK (1024 * 1024)
+#define EOCDSEARCH (65535 + 22)         // Max comment + end of central dir
+
+static BOOL ReadAt(HANDLE hFile, zip_uint64_t offset, void* buffer, DWORD len,
+        DWORD* bytesRead) {
+    OVERLAPPED ov = { 0 };
+    ov.Offset = (DWORD)offset;
+    ov.OffsetHigh = (DWORD)(offset >> 32);
+    return ReadFile(hFile, buffer, len, bytesRead, &ov);
+}
+
+static BOOL WriteAt(HANDLE hFile, zip_uint64_t offset, const void* buffer, 
+        DWORD len) {
+    OVERLAPPED ov = { 0 };
+    DWORD written = 0;
+    ov.Offset = (DWORD)offset;
+    ov.OffsetHigh = (DWORD)(offset >> 32);
+    return WriteFile(hFile, buffer, len, &written, &ov) && written == len;
+}
+
+// Find where the central directory starts in the last bytes of the archive.
+// Returns -1 if it can't be found (eg. ZIP64), in which case nothing but 
+// the tail itself is fetched early.
+static zip_int64_t FindCentralDirectory(const BYTE* tail, DWORD len, 
+        zip_uint64_t tailOffset) {
+    for (zip_int64_t i = (zip_int64_t)len - 22; i >= 0; i--) {
+        unsigned int signature;
+        memcpy(&signature, tail + i, 4);
+        if (signature == 0x06054b50) {
+            unsigned int cdOffset;
+            memcpy(&cdOffset, tail + i + 16, 4);
+            if (cdOffset == 0xFFFFFFFF || cdOffset > tailOffset + i)
+                return -1;
+            return cdOffset;
+        }
     }
-    zip_int64_t num_entries = zip_get_num_entries(zip, /*flags=*/0);
-    const char* exeExt = ".exe";
-    for (zip_int64_t i = 0; i < num_entries; ++i) {
-        const char* name = zip_get_name(zip, i, /*flags=*/0);
-        if (name == NULL) {
-            continue;
+    return -1;
+}
+
+static void PublishStream(STREAMFILE* sf, zip_uint64_t head, BOOL tailDone,
+        BOOL done, BOOL failed) {
+    AcquireSRWLockExclusive(&sf->lock);
+    sf->head = head;
+    sf->tailDone = tailDone;
+    sf->done = done;
+    sf->failed = failed;
+    ReleaseSRWLockExclusive(&sf->lock);
+    WakeAllConditionVariable(&sf->arrived);
+}
+
+static void SaveStreamCheckpoint(STREAMFILE* sf, HANDLE hDst, 
+        zip_uint64_t bytesDone) {
+    FlushFileBuffers(hDst);
+    sf->ckpt.bytesDone = bytesDone;
+    sf->ckpt.tailStart = sf->tailStart;
+    WriteCheckpoint(sf->ckptPath, &sf->ckpt);
+    sf->checkpointed = bytesDone;
+}
+
+// Copy [from, to) of the source to the same place in the local file
+static BOOL FetchRange(STREAMFILE* sf, HANDLE hSrc, HANDLE hDst, BYTE* buffer,
+        zip_uint64_t from, zip_uint64_t to, BOOL publish) {
+    zip_uint64_t offset = from;
+    while (offset < to) {
+        DWORD len = (DWORD)min(STREAMCHUNK, to - offset);
+        DWORD bytesRead = 0;
+        if (sf->cancel || cancelInstall || 
+                !ReadAt(hSrc, offset, buffer, len, &bytesRead) ||
+                bytesRead != len || !WriteAt(hDst, offset, buffer, len)) {
+            return FALSE;
         }
-        // Find exe file
-        char* ext;
-        ext = strchr(name, '.');
-        if (ext == NULL) {
-            continue;
+        offset += len;
+        if (publish) {
+            if (offset - sf->checkpointed >= CHECKPOINTINTERVAL)
+                SaveStreamCheckpoint(sf, hDst, offset);
+            PublishStream(sf, offset, TRUE, FALSE, FALSE);
+            ShowProgress((int)(offset * 100 / sf->size));
         }
+    }
+    return TRUE;
+}
 
-        size_t output_size;
-        wchar_t processNameW[MAX_PATH];
-        if (strcmp(ext, exeExt) == 0) {
-            // Check if it is currently running
-            mbstowcs_s(&output_size, processNameW, 256, name, 256);
-            if (IsProcessRunning(processNameW)) {
-                return 1;
+static DWORD WINAPI StreamFetchProc(LPVOID lpParam) {
+    STREAMFILE* sf = (STREAMFILE*)lpParam;
+    BOOL ok = FALSE;
+    BYTE* buffer = (BYTE*)malloc(max(STREAMCHUNK, EOCDSEARCH));
+    HANDLE hSrc = CreateFile(sf->src, GENERIC_READ, FILE_SHARE_READ, NULL,
+        OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+    HANDLE hDst = CreateFile(sf->dst, GENERIC_WRITE, 
+        FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL,
+        OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+
+    if (buffer != NULL && hSrc != INVALID_HANDLE_VALUE && 
+            hDst != INVALID_HANDLE_VALUE) {
+        // A resumed transfer already has the tail
+        ok = sf->tailDone;
+        if (!ok) {
+            // Tail first: end of central directory record and, from it, 
+            // the central directory itself
+            DWORD tailLen = (DWORD)min(sf->size, EOCDSEARCH);
+            zip_uint64_t tailStart = sf->size - tailLen;
+            DWORD bytesRead = 0;
+            if (ReadAt(hSrc, tailStart, buffer, tailLen, &bytesRead) && 
+                    bytesRead == tailLen && 
+                    WriteAt(hDst, tailStart, buffer, tailLen)) {
+                zip_int64_t cdStart = FindCentralDirectory(buffer, tailLen, 
+                    tailStart);
+                ok = TRUE;
+                if (cdStart >= 0 && (zip_uint64_t)cdStart < tailStart) {
+                    ok = FetchRange(sf, hSrc, hDst, buffer, cdStart, 
+                        tailStart, FALSE);
+                    tailStart = cdStart;
+                }
             }
-            else {
-                return 0;
+            if (ok) {
+                AcquireSRWLockExclusive(&sf->lock);
+                sf->tailStart = tailStart;
+                ReleaseSRWLockExclusive(&sf->lock);
+                PublishStream(sf, 0, TRUE, FALSE, FALSE);
+                SaveStreamCheckpoint(sf, hDst, 0);
             }
         }
+        if (ok) {
+            // Then everything in front of it, in order
+            ok = FetchRange(sf, hSrc, hDst, buffer, sf->head, sf->tailStart, 
+                TRUE);
+        }
     }
-    return -1;
-}
 
-//============================================================================
+    if (hSrc != INVALID_HANDLE_VALUE)
+        CloseHandle(hSrc);
+    if (hDst != INVALID_HANDLE_VALUE)
+        CloseHandle(hDst);
+    free(buffer);
+    // Keep the checkpoint if we didn't finish, so the next run can resume
+    if (ok)
+        DeleteFile(sf->ckptPath);
+    PublishStream(sf, ok ? sf->size : sf->head, sf->tailDone, TRUE, !ok);
+    return ok ? 0 : 1;
+}
 
-static int ExecuteProgram(wchar_t* exePath)
-{
-    STARTUPINFO si;
-    PROCESS_INFORMATION pi;
+// Start pulling src into dst. Returns NULL if the transfer can't start.
+static STREAMFILE* StartStream(const wchar_t* src, const wchar_t* dst) {
+    wchar_t msg[MAX_PATH + 50] = { 0 };
+    CHECKPOINT saved;
+    ULONGLONG remoteTime;
+    STREAMFILE* sf = (STREAMFILE*)calloc(1, sizeof(STREAMFILE));
+    if (sf == NULL) {
+        AddMessage(L"ERROR", L"Memory allocation failed");
+        return NULL;
+    }
+    if (!GetFileSizeAndTime(src, &sf->size, &remoteTime)) {
+        AddMessage(L"ERROR", L"Cannot open source file");
+        free(sf);
+        return NULL;
+    }
+    wcscpy_s(sf->src, MAX_PATH, src);
+    wcscpy_s(sf->dst, MAX_PATH, dst);
+    wcscpy_s(sf->ckptPath, MAX_PATH, dst);
+    wcscat_s(sf->ckptPath, MAX_PATH, L".ckpt");
+    FillCheckpoint(&sf->ckpt, src, sf->size, remoteTime);
+    InitializeSRWLock(&sf->lock);
+    InitializeConditionVariable(&sf->arrived);
+
+    if (sf->size == 0) {
+        AddMessage(L"ERROR", L"Source file is empty or unreadable");
+        free(sf);
+        return NULL;
+    }
+
+    if (ReadCheckpoint(sf->ckptPath, dst, &sf->ckpt, &saved) && 
+            saved.tailStart <= sf->size) {
+        // Carry on where an earlier attempt left off
+        sf->head = saved.bytesDone;
+        sf->tailStart = saved.tailStart;
+        sf->tailDone = TRUE;
+        sf->checkpointed = saved.bytesDone;
+        StringCchPrintf(msg, MAX_PATH + 50, L"Resuming download at %.1f MB",
+            saved.bytesDone / (1024.0 * 1024.0));
+        AddMessage(L"INFO", msg);
+    } else {
+        // Create the local file at full size so readers can open it right
+        // away
+        LARGE_INTEGER size;
+        size.QuadPart = (LONGLONG)sf->size;
+        DeleteFile(sf->ckptPath);
+        HANDLE hDst = CreateFile(dst, GENERIC_WRITE, 
+            FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL, 
+            CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+        if (hDst == INVALID_HANDLE_VALUE || 
+                !SetFilePointerEx(hDst, size, NULL, FILE_BEGIN) || 
+                !SetEndOfFile(hDst)) {
+            if (hDst != INVALID_HANDLE_VALUE)
+                CloseHandle(hDst);
+            wcscpy_s(msg, MAX_PATH + 50, L"Cannot create destination file ");
+            wcscat_s(msg, MAX_PATH + 50, dst);
+            AddMessage(L"ERROR", msg);
+            free(sf);
+            return NULL;
+        }
+        CloseHandle(hDst);
+    }
+
+    wcscpy_s(msg, MAX_PATH + 50, L"Streaming zip file from server: ");
+    wcscat_s(msg, MAX_PATH + 50, src);
+    AddMessage(L"INFO", msg);
+    ShowProgress(0);
+
+    sf->hThread = CreateThread(NULL, 0, StreamFetchProc, sf, 0, NULL);
+    if (sf->hThread == NULL) {
+        AddMessage(L"ERROR", L"Unable to start download thread");
+        HideProgress();
+        free(sf);
+        return NULL;
+    }
+    return sf;
+}
+
+static BOOL StreamRangeReady(STREAMFILE* sf, zip_uint64_t offset, 
+        zip_uint64_t len) {
+    return offset + len <= sf->head || 
+        (sf->tailDone && offset >= sf->tailStart);
+}
+
+// Block until [offset, offset + len) has arrived
+static BOOL WaitForStreamRange(STREAMFILE* sf, zip_uint64_t offset, 
+        zip_uint64_t len) {
+    AcquireSRWLockExclusive(&sf->lock);
+    while (!StreamRangeReady(sf, offset, len) && !sf->done) {
+        SleepConditionVariableSRW(&sf->arrived, &sf->lock, INFINITE, 0);
+    }
+    BOOL ready = StreamRangeReady(sf, offset, len);
+    ReleaseSRWLockExclusive(&sf->lock);
+    return ready;
+}
+
+// Wait for the whole file. Returns FALSE if the transfer failed.
+static BOOL WaitForStream(STREAMFILE* sf) {
+    WaitForSingleObject(sf->hThread, INFINITE);
+    HideProgress();
+    return !sf->failed;
+}
+
+// Stop the transfer if it is still running and free it
+static void CloseStream(STREAMFILE* sf) {
+    if (sf == NULL)
+        return;
+    InterlockedExchange(&sf->cancel, 1);
+    WaitForStream(sf);
+    CloseHandle(sf->hThread);
+    free(sf);
+}
+
+static zip_int64_t StreamSourceProc(void* userdata, void* data, 
+        zip_uint64_t len, zip_source_cmd_t cmd) {
+    STREAMREADER* r = (STREAMREADER*)userdata;
+    zip_uint64_t size = r->stream->size;
+
+    switch (cmd) {
+    case ZIP_SOURCE_OPEN:
+        r->offset = 0;
+        return 0;
+    case ZIP_SOURCE_READ: {
+        DWORD bytesRead = 0;
+        if (r->offset >= size)
+            return 0;
+        len = min(len, min(size - r->offset, 0x40000000));
+        if (!WaitForStreamRange(r->stream, r->offset, len) ||
+                !ReadAt(r->hFile, r->offset, data, (DWORD)len, &bytesRead)) {
+            zip_error_set(&r->error, ZIP_ER_READ, (int)GetLastError());
+            return -1;
+        }
+        r->offset += bytesRead;
+        return bytesRead;
+    }
+    case ZIP_SOURCE_CLOSE:
+        return 0;
+    case ZIP_SOURCE_STAT: {
+        zip_stat_t* st = ZIP_SOURCE_GET_ARGS(zip_stat_t, data, len, 
+            &r->error);
+        if (st == NULL)
+            return -1;
+        zip_stat_init(st);
+        st->size = size;
+        st->valid |= ZIP_STAT_SIZE;
+        return sizeof(zip_stat_t);
+    }
+    case ZIP_SOURCE_ERROR:
+        return zip_error_to_data(&r->error, data, len);
+    case ZIP_SOURCE_FREE:
+        CloseHandle(r->hFile);
+        zip_error_fini(&r->error);
+        free(r);
+        return 0;
+    case ZIP_SOURCE_SEEK: {
+        zip_int64_t offset = zip_source_seek_compute_offset(r->offset, size,
+            data, len, &r->error);
+        if (offset < 0)
+            return -1;
+        r->offset = (zip_uint64_t)offset;
+        return 0;
+    }
+    case ZIP_SOURCE_TELL:
+        return (zip_int64_t)r->offset;
+    case ZIP_SOURCE_SUPPORTS:
+        return zip_source_make_command_bitmap(ZIP_SOURCE_OPEN, 
+            ZIP_SOURCE_READ, ZIP_SOURCE_CLOSE, ZIP_SOURCE_STAT, 
+            ZIP_SOURCE_ERROR, ZIP_SOURCE_FREE, ZIP_SOURCE_SEEK, 
+            ZIP_SOURCE_TELL, ZIP_SOURCE_SUPPORTS, -1);
+    default:
+        zip_error_set(&r->error, ZIP_ER_OPNOTSUPP, 0);
+        return -1;
+    }
+}
+
+//============================================================================
+// Set up an ARCHIVE for path. With MAPARCHIVE the whole file is mapped 
+// once here; if that fails the archive is read from the file as usual.
+
+static void InitArchive(ARCHIVE* archive, const wchar_t* path, 
+        STREAMFILE* stream) {
+    LARGE_INTEGER size = { 0 };
+
+    memset(archive, 0, sizeof(ARCHIVE));
+    wcscpy_s(archive->path, MAX_PATH, path);
+    archive->stream = stream;
+    // A stream is still being written, so it can't be mapped
+    if (MAPARCHIVE == FALSE || stream != NULL)
+        return;
+
+    HANDLE hFile = CreateFile(path, GENERIC_READ, FILE_SHARE_READ, NULL,
+        OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_RANDOM_ACCESS, NULL);
+    if (hFile == INVALID_HANDLE_VALUE)
+        return;
+    if (GetFileSizeEx(hFile, &size) && size.QuadPart > 0 && 
+            (ULONGLONG)size.QuadPart <= (SIZE_T)-1) {
+        archive->hMapping = CreateFileMapping(hFile, NULL, PAGE_READONLY, 
+            0, 0, NULL);
+    }
+    // The mapping keeps its own reference to the file
+    CloseHandle(hFile);
+    if (archive->hMapping != NULL) {
+        archive->view = (const BYTE*)MapViewOfFile(archive->hMapping, 
+            FILE_MAP_READ, 0, 0, 0);
+    }
+    if (archive->view == NULL) {
+        if (archive->hMapping != NULL)
+            CloseHandle(archive->hMapping);
+        archive->hMapping = NULL;
+        AddMessage(L"INFO", L"Cannot map zip file, reading it instead");
+        return;
+    }
+    archive->size = (zip_uint64_t)size.QuadPart;
+    if (DEBUG == TRUE)
+        AddMessage(L"DEBUG", L"InitArchive: zip file mapped");
+}
+
+//============================================================================
+// Open the zip at path with libzip. The path goes to Windows as it is, 
+// not narrowed to the ANSI code page.
+
+static zip_t* OpenZipFile(const wchar_t* path, int flags, int* err) {
+    zip_error_t error;
+    zip_error_init(&error);
+    zip_t* z = NULL;
+    zip_source_t* src = zip_source_win32w_create(path, 0, -1, &error);
+    if (src != NULL) {
+        z = zip_open_from_source(src, flags, &error);
+        if (z == NULL)
+            zip_source_free(src);
+    }
+    if (z == NULL)
+        *err = zip_error_code_zip(&error);
+    zip_error_fini(&error);
+    return z;
+}
+
+//============================================================================
+// Open an archive from disk, from its mapping, or from a stream that may 
+// still be arriving
+
+static zip_t* OpenArchive(const ARCHIVE* archive, int* err) {
+    STREAMFILE* stream = archive->stream;
+    if (archive->view != NULL) {
+        zip_error_t error;
+        zip_error_init(&error);
+        // The mapping outlives every handle, so libzip mustn't free it
+        zip_source_t* src = zip_source_buffer_create(archive->view, 
+            archive->size, 0, &error);
+        zip_t* z = NULL;
+        if (src != NULL) {
+            z = zip_open_from_source(src, ZIP_RDONLY, &error);
+            if (z == NULL)
+                zip_source_free(src);
+        }
+        if (z == NULL)
+            *err = zip_error_code_zip(&error);
+        zip_error_fini(&error);
+        return z;
+    }
+    if (stream == NULL)
+        return OpenZipFile(archive->path, ZIP_RDONLY, err);
+
+    STREAMREADER* r = (STREAMREADER*)calloc(1, sizeof(STREAMREADER));
+    if (r == NULL) {
+        *err = ZIP_ER_MEMORY;
+        return NULL;
+    }
+    r->stream = stream;
+    r->hFile = CreateFile(stream->dst, GENERIC_READ, 
+        FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL,
+        OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (r->hFile == INVALID_HANDLE_VALUE) {
+        *err = ZIP_ER_OPEN;
+        free(r);
+        return NULL;
+    }
+    zip_error_init(&r->error);
+
+    zip_error_t error;
+    zip_error_init(&error);
+    zip_source_t* src = zip_source_function_create(StreamSourceProc, r, 
+        &error);
+    if (src == NULL) {
+        *err = zip_error_code_zip(&error);
+        zip_error_fini(&error);
+        CloseHandle(r->hFile);
+        zip_error_fini(&r->error);
+        free(r);
+        return NULL;
+    }
+    zip_t* z = zip_open_from_source(src, ZIP_RDONLY, &error);
+    if (z == NULL) {
+        *err = zip_error_code_zip(&error);
+        zip_source_free(src);       // Frees the reader too
+    }
+    zip_error_fini(&error);
+    return z;
+}
+
+//============================================================================
+// Compression methods by name, for messages and --recompress. What can 
+// actually be read or written depends on how libzip was built.
+
+typedef struct {
+    const wchar_t* name;
+    zip_int32_t method;
+} METHODNAME;
+
+static const METHODNAME METHODS[] = {
+    { L"store", ZIP_CM_STORE },
+    { L"deflate", ZIP_CM_DEFLATE },
+    { L"bzip2", ZIP_CM_BZIP2 },
+    { L"lzma", ZIP_CM_LZMA },
+    { L"zstd", ZIP_CM_ZSTD },
+    { L"xz", ZIP_CM_XZ }
+};
+#define METHODCOUNT (sizeof(METHODS) / sizeof(METHODS[0]))
+
+static const wchar_t* MethodName(zip_int32_t method) {
+    for (int i = 0; i < (int)METHODCOUNT; i++) {
+        if (METHODS[i].method == method)
+            return METHODS[i].name;
+    }
+    return L"unknown";
+}
+
+// Returns -1 if name isn't a method
+static zip_int32_t ParseMethod(const wchar_t* name) {
+    for (int i = 0; i < (int)METHODCOUNT; i++) {
+        if (_wcsicmp(METHODS[i].name, name) == 0)
+            return METHODS[i].method;
+    }
+    return -1;
+}
+
+//============================================================================
+// Native central directory reader. Only the end of the file is mapped: 
+// first the end records, then the directory itself, which is walked in 
+// place. ZIP64 archives (over 4 GB or 65535 entries) are followed; split
+// archives and data before the first entry are left to libzip.
+
+// File bytes [offset, offset + length) in the view, mapping more of the 
+// end of the file if needed, which moves pointers from earlier calls
+static const BYTE* ZipDirBytes(ZIPDIR* dir, ULONGLONG offset, 
+        ULONGLONG length) {
+    if (length > dir->fileSize || offset > dir->fileSize - length)
+        return NULL;
+    if (offset < dir->viewStart && dir->hMapping != NULL) {
+        SYSTEM_INFO si;
+        GetSystemInfo(&si);
+        ULONGLONG start = offset - offset % si.dwAllocationGranularity;
+        if (dir->fileSize - start > (SIZE_T)-1)
+            return NULL;
+        if (dir->view != NULL)
+            UnmapViewOfFile(dir->view);
+        dir->view = (const BYTE*)MapViewOfFile(dir->hMapping, FILE_MAP_READ,
+            (DWORD)(start >> 32), (DWORD)start, 
+            (SIZE_T)(dir->fileSize - start));
+        dir->viewStart = dir->view != NULL ? start : dir->fileSize;
+    }
+    if (offset < dir->viewStart)
+        return NULL;
+    return dir->view + (offset - dir->viewStart);
+}
+
+static void CloseZipDir(ZIPDIR* dir) {
+    if (dir->hMapping != NULL) {
+        if (dir->view != NULL)
+            UnmapViewOfFile(dir->view);
+        CloseHandle(dir->hMapping);
+    }
+    if (dir->hFile != NULL)
+        CloseHandle(dir->hFile);
+    memset(dir, 0, sizeof(ZIPDIR));
+}
+
+// Find the central directory of the zip at path, or in view if the whole
+// file is mapped already
+static int OpenZipDir(ZIPDIR* dir, const wchar_t* path, const BYTE* view,
+        ULONGLONG viewSize) {
+    LARGE_INTEGER size = { 0 };
+    end_of_central_dir eocd;
+    zip64_locator locator;
+    zip64_end_of_central_dir eocd64;
+
+    memset(dir, 0, sizeof(ZIPDIR));
+    if (view != NULL) {
+        dir->view = view;
+        dir->fileSize = viewSize;
+    } else {
+        dir->hFile = CreateFile(path, GENERIC_READ, FILE_SHARE_READ, NULL,
+            OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+        if (dir->hFile == INVALID_HANDLE_VALUE) {
+            dir->hFile = NULL;
+            return -1;
+        }
+        if (!GetFileSizeEx(dir->hFile, &size) || size.QuadPart <= 0)
+            return -1;
+        dir->fileSize = (ULONGLONG)size.QuadPart;
+        dir->viewStart = dir->fileSize;
+        dir->hMapping = CreateFileMapping(dir->hFile, NULL, PAGE_READONLY,
+            0, 0, NULL);
+        if (dir->hMapping == NULL)
+            return -1;
+    }
+    if (dir->fileSize < sizeof(end_of_central_dir))
+        return -1;
+
+    // The end record is last but for a comment of up to 64 KB
+    ULONGLONG tail = min(dir->fileSize, EOCDSEARCH);
+    ULONGLONG tailStart = dir->fileSize - tail;
+    const BYTE* p = ZipDirBytes(dir, tailStart, tail);
+    if (p == NULL)
+        return -1;
+    ULONGLONG at = tail - sizeof(end_of_central_dir) + 1;
+    while (at-- > 0) {
+        memcpy(&eocd, p + at, sizeof(eocd));
+        if (eocd.signature == EOCDSIG && 
+                at + sizeof(eocd) + eocd.comment_length <= tail)
+            break;
+    }
+    if (at == (ULONGLONG)-1 || eocd.disk != 0 || eocd.cd_disk != 0)
+        return -1;
+    ULONGLONG eocdStart = tailStart + at;
+    ULONGLONG cdEnd = eocdStart;
+    dir->count = eocd.total_entries;
+    dir->cdStart = eocd.cd_offset;
+    dir->cdSize = eocd.cd_size;
+
+    // ZIP64 keeps the real counts and offsets in a record that the 
+    // locator, just before the end record, points at
+    if (eocdStart >= sizeof(zip64_locator)) {
+        p = ZipDirBytes(dir, eocdStart - sizeof(zip64_locator), 
+            sizeof(zip64_locator));
+        if (p == NULL)
+            return -1;
+        memcpy(&locator, p, sizeof(locator));
+    } else {
+        locator.signature = 0;
+    }
+    if (locator.signature == ZIP64LOCATORSIG) {
+        p = ZipDirBytes(dir, locator.eocd64_offset, sizeof(eocd64));
+        if (p == NULL)
+            return -1;
+        memcpy(&eocd64, p, sizeof(eocd64));
+        if (eocd64.signature != ZIP64EOCDSIG || eocd64.cd_disk != 0)
+            return -1;
+        cdEnd = locator.eocd64_offset;
+        dir->count = eocd64.total_entries;
+        dir->cdStart = eocd64.cd_offset;
+        dir->cdSize = eocd64.cd_size;
+    }
+
+    // Anything between the directory and the end records, or a count that
+    // can't fit, means offsets this reader would get wrong
+    if (dir->cdStart > cdEnd || dir->cdSize != cdEnd - dir->cdStart ||
+            dir->count > dir->cdSize / sizeof(central_file_header))
+        return -1;
+    dir->cd = ZipDirBytes(dir, dir->cdStart, dir->cdSize);
+    return dir->cd != NULL ? 0 : -1;
+}
+
+// Read the record at *pos, from the start of the directory, and move *pos
+// past it. FALSE at the end of the directory or a damaged record.
+static BOOL NextZipEntry(const ZIPDIR* dir, ULONGLONG* pos, 
+        ZIPDIRENTRY* entry) {
+    central_file_header h;
+
+    if (dir->cdSize - *pos < sizeof(h))
+        return FALSE;
+    const BYTE* p = dir->cd + *pos;
+    memcpy(&h, p, sizeof(h));
+    ULONGLONG length = sizeof(h) + (ULONGLONG)h.filename_length + 
+        h.extra_length + h.comment_length;
+    if (h.signature != CENTRALHEADERSIG || length > dir->cdSize - *pos)
+        return FALSE;
+
+    entry->name = (const char*)p + sizeof(h);
+    entry->nameLength = h.filename_length;
+    entry->utf8 = (h.bit_flag & UTF8NAMEFLAG) != 0;
+    entry->method = h.compression;
+    entry->flags = h.bit_flag;
+    entry->crc = h.crc32;
+    entry->size = h.uncompressed_size;
+    entry->compSize = h.compressed_size;
+    entry->offset = h.local_header_offset;
+
+    // Values too big for 32 bits are 0xFFFFFFFF here, and follow in the 
+    // ZIP64 extra field, in this order
+    const BYTE* extra = p + sizeof(h) + h.filename_length;
+    unsigned int at = 0;
+    while (at + 4 <= h.extra_length) {
+        unsigned short id, fieldSize;
+        memcpy(&id, extra + at, 2);
+        memcpy(&fieldSize, extra + at + 2, 2);
+        at += 4;
+        if (fieldSize > h.extra_length - at)
+            return FALSE;
+        if (id == ZIP64EXTRAID) {
+            ULONGLONG* values[3] = { &entry->size, &entry->compSize, 
+                &entry->offset };
+            unsigned int used = 0;
+            for (int i = 0; i < 3; i++) {
+                if (*values[i] != 0xFFFFFFFF)
+                    continue;
+                if (fieldSize - used < 8)
+                    return FALSE;
+                memcpy(values[i], extra + at + used, 8);
+                used += 8;
+            }
+        } else if (id == UNICODEPATHID && fieldSize > 5 && 
+                extra[at] == 1) {
+            // Only while it still matches the name it was made from
+            unsigned int nameCrc;
+            memcpy(&nameCrc, extra + at + 1, 4);
+            zip_uint32_t crc = Crc32Update(0, p + sizeof(h), 
+                h.filename_length);
+            if (nameCrc == crc) {
+                entry->name = (const char*)extra + at + 5;
+                entry->nameLength = fieldSize - 5;
+                entry->utf8 = TRUE;
+            }
+        }
+        at += fieldSize;
+    }
+    *pos += length;
+    return TRUE;
+}
+
+// Code page 437 from 0x80 up, which a name is in unless it says otherwise
+static const unsigned short CP437HIGH[128] = {
+    0x00C7, 0x00FC, 0x00E9, 0x00E2, 0x00E4, 0x00E0, 0x00E5, 0x00E7,
+    0x00EA, 0x00EB, 0x00E8, 0x00EF, 0x00EE, 0x00EC, 0x00C4, 0x00C5,
+    0x00C9, 0x00E6, 0x00C6, 0x00F4, 0x00F6, 0x00F2, 0x00FB, 0x00F9,
+    0x00FF, 0x00D6, 0x00DC, 0x00A2, 0x00A3, 0x00A5, 0x20A7, 0x0192,
+    0x00E1, 0x00ED, 0x00F3, 0x00FA, 0x00F1, 0x00D1, 0x00AA, 0x00BA,
+    0x00BF, 0x2310, 0x00AC, 0x00BD, 0x00BC, 0x00A1, 0x00AB, 0x00BB,
+    0x2591, 0x2592, 0x2593, 0x2502, 0x2524, 0x2561, 0x2562, 0x2556,
+    0x2555, 0x2563, 0x2551, 0x2557, 0x255D, 0x255C, 0x255B, 0x2510,
+    0x2514, 0x2534, 0x252C, 0x251C, 0x2500, 0x253C, 0x255E, 0x255F,
+    0x255A, 0x2554, 0x2569, 0x2566, 0x2560, 0x2550, 0x256C, 0x2567,
+    0x2568, 0x2564, 0x2565, 0x2559, 0x2558, 0x2552, 0x2553, 0x256B,
+    0x256A, 0x2518, 0x250C, 0x2588, 0x2584, 0x258C, 0x2590, 0x2580,
+    0x03B1, 0x00DF, 0x0393, 0x03C0, 0x03A3, 0x03C3, 0x00B5, 0x03C4,
+    0x03A6, 0x0398, 0x03A9, 0x03B4, 0x221E, 0x03C6, 0x03B5, 0x2229,
+    0x2261, 0x00B1, 0x2265, 0x2264, 0x2320, 0x2321, 0x00F7, 0x2248,
+    0x00B0, 0x2219, 0x00B7, 0x221A, 0x207F, 0x00B2, 0x25A0, 0x00A0,
+};
+
+// Write e's name to out as UTF-8, unterminated, and return its length. 
+// With out NULL only the length is returned.
+static size_t ZipNameToUtf8(const ZIPDIRENTRY* e, char* out) {
+    if (e->utf8) {
+        if (out != NULL)
+            memcpy(out, e->name, e->nameLength);
+        return e->nameLength;
+    }
+    size_t length = 0;
+    for (unsigned int i = 0; i < e->nameLength; i++) {
+        BYTE c = (BYTE)e->name[i];
+        unsigned short u = c < 0x80 ? c : CP437HIGH[c - 0x80];
+        if (u < 0x80) {
+            if (out != NULL)
+                out[length] = (char)u;
+            length += 1;
+        } else if (u < 0x800) {
+            if (out != NULL) {
+                out[length] = (char)(0xC0 | (u >> 6));
+                out[length + 1] = (char)(0x80 | (u & 0x3F));
+            }
+            length += 2;
+        } else {
+            if (out != NULL) {
+                out[length] = (char)(0xE0 | (u >> 12));
+                out[length + 1] = (char)(0x80 | ((u >> 6) & 0x3F));
+                out[length + 2] = (char)(0x80 | (u & 0x3F));
+            }
+            length += 3;
+        }
+    }
+    return length;
+}
+
+// Index archive from its central directory without libzip. Names are 
+// converted to UTF-8, as libzip gives them, and copied, terminated, into 
+// one block sized by a first pass over the directory. Returns -1 if the 
+// directory can't be followed, for libzip to try.
+static int ReadZipDir(ARCHIVE* archive) {
+    ZIPDIR dir;
+    ZIPDIRENTRY e;
+    ULONGLONG pos = 0;
+    size_t used = 0;
+
+    if (OpenZipDir(&dir, archive->path, archive->view, archive->size) != 0
+            || dir.cdSize >= (SIZE_T)-1) {
+        CloseZipDir(&dir);
+        return -1;
+    }
+    ULONGLONG count = dir.count;
+    size_t namesSize = 1;
+    for (ULONGLONG i = 0; i < count && NextZipEntry(&dir, &pos, &e); i++)
+        namesSize += ZipNameToUtf8(&e, NULL) + 1;
+    pos = 0;
+    archive->entries = (EXTRACTENTRY*)malloc((size_t)(count + 1) * 
+            sizeof(EXTRACTENTRY));
+    archive->names = (char*)malloc(namesSize);
+    if (archive->entries != NULL && archive->names != NULL) {
+        for (ULONGLONG i = 0; i < count; i++) {
+            if (!NextZipEntry(&dir, &pos, &e))
+                break;
+            EXTRACTENTRY* entry = &archive->entries[archive->count++];
+            entry->index = i;
+            entry->size = e.size;
+            entry->compSize = e.compSize;
+            entry->crc = e.crc;
+            entry->method = e.method;
+            entry->hasCrc = TRUE;
+            entry->offset = e.offset;
+            size_t length = ZipNameToUtf8(&e, archive->names + used);
+            archive->names[used + length] = '\0';
+            entry->name = archive->names + used;
+            used += length + 1;
+        }
+    }
+    CloseZipDir(&dir);
+    if ((ULONGLONG)archive->count != count) {
+        free(archive->entries);
+        free(archive->names);
+        archive->entries = NULL;
+        archive->names = NULL;
+        archive->count = 0;
+        return -1;
+    }
+    return 0;
+}
+
+//============================================================================
+// Read the central directory through libzip. The handle stays open for 
+// the extracting thread.
+
+static int ReadLibzipDir(ARCHIVE* archive) {
+    int err = 0;
+
+    archive->z = OpenArchive(archive, &err);
+    if (archive->z == NULL) {
+        AddMessage(L"ERROR", L"Failed to open ZIP file");
+        return -1;
+    }
+
+    zip_int64_t num_entries = zip_get_num_entries(archive->z, 0);
+    archive->entries = (EXTRACTENTRY*)malloc((num_entries + 1) * 
+            sizeof(EXTRACTENTRY));
+    if (archive->entries == NULL) {
+        AddMessage(L"ERROR", L"Memory allocation failed");
+        zip_discard(archive->z);
+        archive->z = NULL;
+        return -1;
+    }
+    for (zip_int64_t i = 0; i < num_entries; i++) {
+        struct zip_stat st;
+        // Strict, like ZipNameToUtf8: a name without the UTF-8 flag is 
+        // code page 437 even if it happens to be valid UTF-8
+        if (zip_stat_index(archive->z, i, ZIP_FL_ENC_STRICT, &st) != 0 || 
+                !(st.valid & ZIP_STAT_NAME)) {
+            AddMessage(L"ERROR", L"Failed to get file information");
+            archive->incomplete = TRUE;
+            continue;
+        }
+        EXTRACTENTRY* entry = &archive->entries[archive->count++];
+        entry->index = (zip_uint64_t)i;
+        entry->size = (st.valid & ZIP_STAT_SIZE) ? st.size : 0;
+        entry->compSize = (st.valid & ZIP_STAT_COMP_SIZE) ? st.comp_size : 0;
+        entry->crc = st.crc;
+        entry->method = (st.valid & ZIP_STAT_COMP_METHOD) ? 
+            st.comp_method : ZIP_CM_DEFLATE;
+        entry->hasCrc = (st.valid & ZIP_STAT_CRC) != 0;
+        entry->name = st.name;
+        entry->offset = NOOFFSET;
+    }
+    return 0;
+}
+
+// Entry names are UTF-8, whichever reader indexed them. Convert len bytes
+// of one, or all of it if len is -1, to out for Windows.
+static BOOL EntryNameToWide(const char* name, int len, wchar_t* out, 
+        int outSize) {
+    if (len < 0)
+        len = (int)strlen(name);
+    int converted = len > 0 && outSize > 1 ? MultiByteToWideChar(CP_UTF8, 
+        MB_ERR_INVALID_CHARS, name, len, out, outSize - 1) : 0;
+    out[converted] = L'\0';
+    return converted > 0 || len == 0;
+}
+
+//============================================================================
+// Read the central directory into archive. Does nothing if it already has
+// been. A local zip is read by ReadZipDir; a stream, whose directory may 
+// not have arrived yet, and anything ReadZipDir can't follow go through
+// libzip.
+
+static int IndexArchive(ARCHIVE* archive) {
+    wchar_t msg[MAX_PATH + 50] = { 0 };
+    int exeDepth = -1;
+
+    if (archive->entries != NULL)
+        return archive->unreadable ? -1 : 0;
+    if (archive->stream != NULL || ReadZipDir(archive) != 0) {
+        if (ReadLibzipDir(archive) != 0)
+            return -1;
+    }
+
+    for (LONG i = 0; i < archive->count; i++) {
+        const EXTRACTENTRY* entry = &archive->entries[i];
+
+        // Better to say so now than fail halfway through extracting
+        if (!archive->unreadable && 
+                !zip_compression_method_supported(entry->method, 0)) {
+            StringCchPrintf(msg, MAX_PATH + 50, 
+                L"This installer can't decompress %s entries", 
+                MethodName(entry->method));
+            AddMessage(L"ERROR", msg);
+            archive->unreadable = TRUE;
+        }
+
+        // The entry point is the exe nearest the top of the archive
+        size_t len = strlen(entry->name);
+        if (len > 4 && _stricmp(entry->name + len - 4, ".exe") == 0) {
+            int depth = 0;
+            for (const char* c = entry->name; *c; c++) {
+                if (*c == '/')
+                    depth++;
+            }
+            if ((exeDepth < 0 || depth < exeDepth) && 
+                    EntryNameToWide(entry->name, (int)len, archive->exeName,
+                    MAX_PATH)) {
+                exeDepth = depth;
+            }
+        }
+    }
+    for (wchar_t* c = archive->exeName; *c; c++) {
+        if (*c == L'/')
+            *c = L'\\';
+    }
+    if (DEBUG == TRUE) {
+        StringCchPrintf(msg, MAX_PATH + 50, 
+            L"IndexArchive: %ld entries%s, entry point '%s'", archive->count,
+            archive->names != NULL ? L" read natively" : L"",
+            archive->exeName);
+        AddMessage(L"DEBUG", msg);
+    }
+    return archive->unreadable ? -1 : 0;
+}
+
+// Release the index, handle and mapping. Without the download cache the
+// local zip is deleted too.
+static void CloseArchive(ARCHIVE* archive) {
+    wchar_t msg[MAX_PATH + 20] = { 0 };
+
+    if (archive->z != NULL)
+        zip_discard(archive->z);
+    free(archive->entries);
+    free(archive->names);
+    archive->z = NULL;
+    archive->entries = NULL;
+    archive->names = NULL;
+    archive->count = 0;
+    if (archive->view != NULL)
+        UnmapViewOfFile(archive->view);
+    if (archive->hMapping != NULL)
+        CloseHandle(archive->hMapping);
+    archive->view = NULL;
+    archive->hMapping = NULL;
+    archive->granularity = 0;
+    archive->size = 0;
+
+    // Delete generally returns 0 which is a fail. A damaged zip goes 
+    // too, or the cache would hand it back next time.
+    if ((USECACHE == FALSE || archive->damaged) && 
+            FileExists(archive->path)) {
+        if (DeleteFile(archive->path) == 0 && DEBUG == TRUE) {
+            swprintf(msg, MAX_PATH + 20, L"Unable to delete %s", 
+                archive->path);
+            AddMessage(L"DEBUG", msg);
+        }
+    }
+}
+
+//============================================================================
+
+static int CheckIfRunning(ARCHIVE* archive) {
+    if (DEBUG == TRUE)
+        AddMessage(L"DEBUG", L"417 CheckIfRunning...");
+    // The executable named in the zip file
+    if (IndexArchive(archive) != 0 || wcslen(archive->exeName) == 0) {
+        return -1;
+    }
+    if (IsProcessRunning(PathFindFileName(archive->exeName))) {
+        return 1;
+    }
+    else {
+        return 0;
+    }
+}
+
+//============================================================================
+
+static int ExecuteProgram(wchar_t* exePath)
+{
+    STARTUPINFO si;
+    PROCESS_INFORMATION pi;
 
     ZeroMemory(&si, sizeof(si));
     si.cb = sizeof(si);
@@ -479,9 +2558,7 @@ static BOOL FindShortcut(LPCTSTR shortcutName, LPTSTR targetDir,
         DWORD targetDirSize,
     LPTSTR shortcutPath, DWORD shortcutPathSize) {
     TCHAR startMenuPath[MAX_PATH];
-    HRESULT hr = SHGetFolderPath(NULL, CSIDL_PROGRAMS, NULL, 0, startMenuPath);
-
-    if (SUCCEEDED(hr)) {
+    if (GetProgramsFolder(startMenuPath)) {
         TCHAR searchPath[MAX_PATH];
         StringCchPrintf(searchPath, MAX_PATH, _T("%s\\%s.lnk"), startMenuPath,
             shortcutName);
@@ -543,6 +2620,8 @@ static wchar_t* GetNewestFileInDir(const wchar_t* dirLoc,
     wchar_t searchLoc[MAX_PATH];
     wchar_t* returnPath = (wchar_t*)malloc(MAX_PATH * sizeof(wchar_t));
     wchar_t msg[MAX_PATH + 30] = { 0 };
+    LARGE_INTEGER start;
+    QueryPerformanceCounter(&start);
     if (returnPath == NULL) {
         AddMessage(L"ERROR", L"Memory allocation failed");
         return NULL;
@@ -560,14 +2639,17 @@ static wchar_t* GetNewestFileInDir(const wchar_t* dirLoc,
 
     if (hFind == INVALID_HANDLE_VALUE) {
         free(returnPath);
+        TraceCall(L"GetNewestFileInDir", dirLoc, &start, FALSE, 0, 0);
         return NULL;
     }
 
     FILETIME latestTime = { 0 };
+    LONG files = 0;
     wchar_t latestFile[MAX_PATH] = { 0 };
 
     do {
         if (!(findFileData.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)) {
+            files++;
             if (CompareFileTime(&findFileData.ftLastWriteTime, &latestTime) > 0) {
                 latestTime = findFileData.ftLastWriteTime;
                 wcscpy_s(latestFile, MAX_PATH, findFileData.cFileName);
@@ -587,177 +2669,1349 @@ static wchar_t* GetNewestFileInDir(const wchar_t* dirLoc,
         AddMessage(L"DEBUG", msg);
     }
 
+    TraceCall(L"GetNewestFileInDir", dirLoc, &start, TRUE, 0, files);
     return returnPath;
 }
 
 //============================================================================
+// Local download cache. cache.ini in the Worley folder records, for each 
+// local zip, the size and last write time of the server file it was copied 
+// from and optionally the CRC32 of the copy. If the server file hasn't 
+// changed the download is skipped. Hit/miss totals are kept in [Stats].
+
+static wchar_t CACHEINDEX[MAX_PATH] = { 0 };
+static SRWLOCK cacheLock = SRWLOCK_INIT;       // Guards the [Stats] totals
+
+static ULONGLONG ReadIniValue(const wchar_t* file, const wchar_t* section, 
+        const wchar_t* key, int radix) {
+    wchar_t value[32] = { 0 };
+    GetPrivateProfileString(section, key, L"", value, 32, file);
+    return _wcstoui64(value, NULL, radix);
+}
 
-static DWORD WINAPI CopyFileWithProgress(LPVOID lpParam) {
-    COPYFILEPARAMS* params = (COPYFILEPARAMS*)lpParam;
-    HWND hwnd = params->hwnd;
-    wchar_t* src = params->src;
-    wchar_t* dst = params->dst;
-
-    ShowWindow(hwndProgressBar, SW_SHOW);
+static void WriteIniValue(const wchar_t* file, const wchar_t* section, 
+        const wchar_t* key, ULONGLONG value) {
+    wchar_t text[32] = { 0 };
+    StringCchPrintf(text, 32, L"%llu", value);
+    WritePrivateProfileString(section, key, text, file);
+}
 
-    FILE* source = _wfopen(src, L"rb");
-    if (!source) {
-        AddMessage(L"ERROR", L"Cannot open source file");
-        free(params);
-        return -1;
-    }
+static ULONGLONG ReadCacheValue(const wchar_t* section, const wchar_t* key,
+        int radix) {
+    return ReadIniValue(CACHEINDEX, section, key, radix);
+}
 
-    FILE* destination = _wfopen(dst, L"wb");
-    if (!destination) {
-        fclose(source);
-        wchar_t msg[MAX_PATH + 30] = { 0 };
-        wcscpy_s(msg, MAX_PATH + 30, L"Cannot create destination file ");
-        wcscat_s(msg, MAX_PATH + 30, dst);
-        AddMessage(L"ERROR", msg);
-        free(params);
-        return -1;
-    }
+static void WriteCacheValue(const wchar_t* section, const wchar_t* key,
+        ULONGLONG value) {
+    WriteIniValue(CACHEINDEX, section, key, value);
+}
 
-    fseek(source, 0, SEEK_END);
-    long totalSize = ftell(source);
-    fseek(source, 0, SEEK_SET);
+// Is dst an up to date copy of src?
+static BOOL CacheLookup(const wchar_t* src, const wchar_t* dst) {
+    const wchar_t* section = PathFindFileName(dst);
+    wchar_t source[MAX_PATH] = { 0 };
+    wchar_t hash[16] = { 0 };
+    wchar_t msg[MAX_PATH + 50] = { 0 };
+    ULONGLONG remoteSize, remoteTime, localSize, localTime;
+    BOOL hit = FALSE;
 
-    if (totalSize <= 0) {
-        fclose(source);
-        fclose(destination);
-        AddMessage(L"ERROR", L"Source file is empty or unreadable");
-        free(params);
-        return -1;
+    if (USECACHE == FALSE || wcslen(CACHEINDEX) == 0) {
+        return FALSE;
+    }
+    if (GetFileSizeAndTime(src, &remoteSize, &remoteTime) &&
+            GetFileSizeAndTime(dst, &localSize, &localTime)) {
+        GetPrivateProfileString(section, L"Source", L"", source, MAX_PATH,
+            CACHEINDEX);
+        hit = _wcsicmp(source, src) == 0 && localSize == remoteSize &&
+            ReadCacheValue(section, L"Size", 10) == remoteSize &&
+            ReadCacheValue(section, L"Time", 10) == remoteTime;
+    }
+    if (hit && VERIFYCACHE == TRUE) {
+        zip_uint32_t crc;
+        GetPrivateProfileString(section, L"Hash", L"", hash, 16, CACHEINDEX);
+        hit = wcslen(hash) > 0 && FileCrc32(dst, &crc) &&
+            crc == (zip_uint32_t)ReadCacheValue(section, L"Hash", 16);
     }
 
-    wchar_t msg[MAX_PATH + 50] = L"Downloading zip file from server: ";
-    wcscat_s(msg, MAX_PATH + 50, src);
+    // No logging while the lock is held: AddMessage may wait for the drain
+    AcquireSRWLockExclusive(&cacheLock);
+    ULONGLONG hits = ReadCacheValue(L"Stats", L"Hits", 10);
+    ULONGLONG misses = ReadCacheValue(L"Stats", L"Misses", 10);
+    ULONGLONG saved = ReadCacheValue(L"Stats", L"BytesSaved", 10);
+    if (hit) {
+        hits++;
+        saved += remoteSize;
+        WriteCacheValue(L"Stats", L"Hits", hits);
+        WriteCacheValue(L"Stats", L"BytesSaved", saved);
+        StringCchPrintf(msg, MAX_PATH + 50, 
+            L"Download cache hit: %s is up to date, skipping copy", section);
+    } else {
+        misses++;
+        WriteCacheValue(L"Stats", L"Misses", misses);
+        // The copy is about to be overwritten
+        WritePrivateProfileString(section, NULL, NULL, CACHEINDEX);
+        StringCchPrintf(msg, MAX_PATH + 50, L"Download cache miss: %s",
+            section);
+    }
+    ReleaseSRWLockExclusive(&cacheLock);
+    AddMessage(L"INFO", msg);
+    StringCchPrintf(msg, MAX_PATH + 50, 
+        L"Download cache: %llu hits, %llu misses, %.1f MB saved", 
+        hits, misses, saved / (1024.0 * 1024.0));
     AddMessage(L"INFO", msg);
+    return hit;
+}
 
-    SendMessage(hwndProgressBar, PBM_SETRANGE, 0, MAKELPARAM(0, 100));
-    SendMessage(hwndProgressBar, PBM_SETPOS, 0, 0);
+// Record that dst is now a complete copy of src
+static void CacheStore(const wchar_t* src, const wchar_t* dst) {
+    const wchar_t* section = PathFindFileName(dst);
+    ULONGLONG size, time;
 
-    wchar_t buffer[4096];
-    size_t copiedSize = 0;
-    size_t bytesRead;
-    while ((bytesRead = fread(buffer, 1, sizeof(buffer), source)) > 0) {
-        fwrite(buffer, 1, bytesRead, destination);
-        copiedSize += bytesRead;
-        int progress = (int)(((double)copiedSize / totalSize) * 100);
-        SendMessage(hwndProgressBar, PBM_SETPOS, progress, 0);
-        // For testing progress bar:
-        //Delay(1);
+    if (USECACHE == FALSE || wcslen(CACHEINDEX) == 0 ||
+            !GetFileSizeAndTime(src, &size, &time)) {
+        return;
+    }
+    WritePrivateProfileString(section, L"Source", src, CACHEINDEX);
+    WriteCacheValue(section, L"Size", size);
+    WriteCacheValue(section, L"Time", time);
+    if (VERIFYCACHE == TRUE) {
+        zip_uint32_t crc;
+        wchar_t hash[16] = { 0 };
+        if (FileCrc32(dst, &crc)) {
+            StringCchPrintf(hash, 16, L"%08lX", (unsigned long)crc);
+            WritePrivateProfileString(section, L"Hash", hash, CACHEINDEX);
+        }
+    }
+}
 
-        // Process pending messages to keep the UI responsive
-        MSG msg;
-        while (PeekMessage(&msg, NULL, 0, 0, PM_REMOVE)) {
-            TranslateMessage(&msg);
-            DispatchMessage(&msg);
+//============================================================================
+// Release index. An application folder on the server can hold a 
+// release.ini, written by --publish, naming its current zip:
+//     [Release]
+//     File=MyApp_1.2.zip
+//     Size=<bytes>
+//     Time=<last write FILETIME>
+// Reading it saves listing folders that hold many old zips. It is ignored
+// if the folder has changed since it was written, or the zip it names 
+// isn't the one it describes, and the folder is listed as before.
+
+#define RELEASEINDEX L"release.ini"
+
+static wchar_t* GetReleaseFile(const wchar_t* dirLoc) {
+    wchar_t index[MAX_PATH] = { 0 };
+    wchar_t file[MAX_PATH] = { 0 };
+    wchar_t msg[MAX_PATH + 50] = { 0 };
+    ULONGLONG indexSize, indexTime, dirSize, dirTime, size, time;
+
+    StringCchPrintf(index, MAX_PATH, L"%s\\%s", dirLoc, RELEASEINDEX);
+    if (GetFileSizeAndTime(index, &indexSize, &indexTime) &&
+            GetFileSizeAndTime(dirLoc, &dirSize, &dirTime) &&
+            dirTime <= indexTime) {
+        GetPrivateProfileString(L"Release", L"File", L"", file, MAX_PATH, 
+            index);
+        wchar_t* returnPath = (wchar_t*)malloc(MAX_PATH * sizeof(wchar_t));
+        if (returnPath != NULL && wcslen(file) > 0 && 
+                wcspbrk(file, L"\\/") == NULL) {
+            StringCchPrintf(returnPath, MAX_PATH, L"%s\\%s", dirLoc, file);
+            if (GetFileSizeAndTime(returnPath, &size, &time) &&
+                    size == ReadIniValue(index, L"Release", L"Size", 10) &&
+                    time == ReadIniValue(index, L"Release", L"Time", 10)) {
+                if (DEBUG == TRUE) {
+                    wcscpy_s(msg, MAX_PATH + 50, 
+                        L"GetReleaseFile: From release index: ");
+                    wcscat_s(msg, MAX_PATH + 50, file);
+                    AddMessage(L"DEBUG", msg);
+                }
+                return returnPath;
+            }
+        }
+        free(returnPath);
+    }
+    if (DEBUG == TRUE) {
+        wcscpy_s(msg, MAX_PATH + 50, 
+            L"GetReleaseFile: No current release index in ");
+        wcscat_s(msg, MAX_PATH + 50, dirLoc);
+        AddMessage(L"DEBUG", msg);
+    }
+    return GetNewestFileInDir(dirLoc, L"\\*.zip");
+}
+
+// A copy of zipPath with every file compressed with method, written next 
+// to it as <name>-<method>.zip. libzip does the compressing when the new
+// archive is closed. Entries are read through the old archive, so it stays
+// open until then.
+static int RecompressZip(const wchar_t* zipPath, zip_int32_t method,
+        wchar_t* outPath) {
+    wchar_t msg[MAX_PATH + 50] = { 0 };
+    int err = 0;
+    BOOL ok = TRUE;
+    ULONGLONG before = 0, after = 0, time;
+    LARGE_INTEGER start;
+    QueryPerformanceCounter(&start);
+
+    wcscpy_s(outPath, MAX_PATH, zipPath);
+    PathCchRemoveExtension(outPath, MAX_PATH);
+    StringCchPrintf(outPath + wcslen(outPath), MAX_PATH - wcslen(outPath),
+        L"-%s.zip", MethodName(method));
+
+    zip_t* in = OpenZipFile(zipPath, ZIP_RDONLY, &err);
+    if (in == NULL) {
+        AddMessage(L"ERROR", L"Failed to open ZIP file");
+        return -1;
+    }
+    zip_t* out = OpenZipFile(outPath, ZIP_CREATE | ZIP_TRUNCATE, &err);
+    if (out == NULL) {
+        AddMessage(L"ERROR", L"Cannot create the recompressed zip");
+        zip_discard(in);
+        return -1;
+    }
+    zip_int64_t count = zip_get_num_entries(in, 0);
+    for (zip_int64_t i = 0; i < count && ok; i++) {
+        const char* name = zip_get_name(in, i, ZIP_FL_ENC_RAW);
+        size_t len = name != NULL ? strlen(name) : 0;
+        if (len == 0) {
+            ok = FALSE;
+        } else if (name[len - 1] == '/') {
+            ok = zip_dir_add(out, name, ZIP_FL_ENC_GUESS) >= 0;
+        } else {
+            zip_source_t* source = zip_source_zip(out, in, i, 0, 0, -1);
+            zip_int64_t added = source == NULL ? -1 : 
+                zip_file_add(out, name, source, ZIP_FL_ENC_GUESS);
+            if (added < 0) {
+                zip_source_free(source);
+                ok = FALSE;
+            } else {
+                ok = zip_set_file_compression(out, added, method, 0) == 0;
+            }
         }
     }
+    if (ok) {
+        ok = zip_close(out) == 0;
+        if (!ok)
+            zip_discard(out);
+    } else {
+        zip_discard(out);
+    }
+    zip_discard(in);
+
+    if (!ok) {
+        StringCchPrintf(msg, MAX_PATH + 50, 
+            L"Cannot recompress with %s: does libzip support it?", 
+            MethodName(method));
+        AddMessage(L"ERROR", msg);
+        DeleteFile(outPath);
+        TraceCall(L"RecompressZip", zipPath, &start, FALSE, 0, 0);
+        return -1;
+    }
+    GetFileSizeAndTime(zipPath, &before, &time);
+    GetFileSizeAndTime(outPath, &after, &time);
+    StringCchPrintf(msg, MAX_PATH + 50, 
+        L"Recompressed with %s: %.1f MB to %.1f MB in %.1f seconds", 
+        MethodName(method), before / (1024.0 * 1024.0), 
+        after / (1024.0 * 1024.0), ElapsedSeconds(&start));
+    AddMessage(L"INFO", msg);
+    TraceCall(L"RecompressZip", zipPath, &start, TRUE, before, (LONG)count);
+    return 0;
+}
+
+// Write the release index for dirLoc, naming its newest zip. With 
+// --recompress that zip is first rewritten with the method asked for, and 
+// the new one is published.
+static int PublishRelease(const wchar_t* dirLoc) {
+    wchar_t index[MAX_PATH] = { 0 };
+    wchar_t msg[MAX_PATH + 50] = { 0 };
+    wchar_t suffix[20] = { 0 };
+    ULONGLONG size, time, dirSize, dirTime;
+    FILETIME indexTime;
+
+    wchar_t* zipPath = GetNewestFileInDir(dirLoc, L"\\*.zip");
+    if (zipPath == NULL) {
+        AddMessage(L"ERROR", L"No zip files found");
+        return -1;
+    }
+    if (RECOMPRESS >= 0) {
+        // Unless the newest is already such a copy
+        StringCchPrintf(suffix, 20, L"-%s.zip", MethodName(RECOMPRESS));
+        size_t len = wcslen(zipPath), suffixLen = wcslen(suffix);
+        if (len <= suffixLen || 
+                _wcsicmp(zipPath + len - suffixLen, suffix) != 0) {
+            wchar_t* packed = (wchar_t*)malloc(MAX_PATH * sizeof(wchar_t));
+            if (packed == NULL || 
+                    RecompressZip(zipPath, RECOMPRESS, packed) != 0) {
+                free(packed);
+                free(zipPath);
+                return -1;
+            }
+            free(zipPath);
+            zipPath = packed;
+        }
+    }
+    if (!GetFileSizeAndTime(zipPath, &size, &time)) {
+        AddMessage(L"ERROR", L"Cannot read the zip file");
+        free(zipPath);
+        return -1;
+    }
+    StringCchPrintf(index, MAX_PATH, L"%s\\%s", dirLoc, RELEASEINDEX);
+    if (!WritePrivateProfileString(L"Release", L"File", 
+            PathFindFileName(zipPath), index)) {
+        AddMessage(L"ERROR", L"Cannot write the release index");
+        free(zipPath);
+        return -1;
+    }
+    WriteIniValue(index, L"Release", L"Size", size);
+    WriteIniValue(index, L"Release", L"Time", time);
+
+    // Writing the index touched the folder, and clients take a folder 
+    // newer than its index to mean the index is stale. Both times must 
+    // come from the server's clock, so the index gets the folder's own, 
+    // read after the last write to it.
+    HANDLE hIndex = INVALID_HANDLE_VALUE;
+    if (GetFileSizeAndTime(dirLoc, &dirSize, &dirTime)) {
+        indexTime.dwLowDateTime = (DWORD)dirTime;
+        indexTime.dwHighDateTime = (DWORD)(dirTime >> 32);
+        hIndex = CreateFile(index, FILE_WRITE_ATTRIBUTES, FILE_SHARE_READ, 
+            NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    }
+    if (hIndex == INVALID_HANDLE_VALUE || 
+            !SetFileTime(hIndex, NULL, NULL, &indexTime)) {
+        AddMessage(L"ERROR", L"Cannot set the release index's time; "
+            L"clients will list the folder instead");
+    }
+    if (hIndex != INVALID_HANDLE_VALUE)
+        CloseHandle(hIndex);
+
+    StringCchPrintf(msg, MAX_PATH + 50, L"Published %s to %s", 
+        PathFindFileName(zipPath), index);
+    AddMessage(L"INFO", msg);
+    free(zipPath);
+    return 0;
+}
+
+//============================================================================
+
+// The original 4 KB stdio copy loop. Kept as the fallback when the 
+// unbuffered engine can't be used, and as the baseline for --benchmark.
+static int CopyFileBuffered(const wchar_t* src, const wchar_t* dst, 
+        ULONGLONG* copied) {
+    FILE* source = _wfopen(src, L"rb");
+    if (!source) {
+        AddMessage(L"ERROR", L"Cannot open source file");
+        return -1;
+    }
+
+    FILE* destination = _wfopen(dst, L"wb");
+    if (!destination) {
+        fclose(source);
+        wchar_t msg[MAX_PATH + 30] = { 0 };
+        wcscpy_s(msg, MAX_PATH + 30, L"Cannot create destination file ");
+        wcscat_s(msg, MAX_PATH + 30, dst);
+        AddMessage(L"ERROR", msg);
+        return -1;
+    }
+
+    fseek(source, 0, SEEK_END);
+    long totalSize = ftell(source);
+    fseek(source, 0, SEEK_SET);
+
+    if (totalSize <= 0) {
+        fclose(source);
+        fclose(destination);
+        AddMessage(L"ERROR", L"Source file is empty or unreadable");
+        return -1;
+    }
+
+    wchar_t buffer[4096];
+    size_t copiedSize = 0;
+    size_t bytesRead;
+    ULONGLONG lastTick = 0;
+    while ((bytesRead = fread(buffer, 1, sizeof(buffer), source)) > 0) {
+        if (cancelInstall)
+            break;
+        fwrite(buffer, 1, bytesRead, destination);
+        copiedSize += bytesRead;
+        ReportProgress(copiedSize, totalSize, &lastTick);
+        // For testing progress bar:
+        //Delay(1);
+    }
 
     fclose(source);
     fclose(destination);
-
-    ShowWindow(hwndProgressBar, SW_HIDE);
-    free(params);
+    *copied = copiedSize;
+    if (cancelInstall) {
+        AddMessage(L"INFO", L"Copy cancelled");
+        return -1;
+    }
     return 0;
-    AddMessage(L"INFO", L"File copy completed");
 }
 
 //============================================================================
+// Unbuffered copy engine. Two large aligned buffers: while one block is 
+// being written the next is already being read. Progress is only reported
+// a few times a second.
+
+#define COPYBLOCK (4 * 1024 * 1024)     // Multiple of any sector size
+#define SECTORALIGN 4096
+#define COPYNOTSUPPORTED 1              // Use CopyFileBuffered instead
+
+typedef struct {
+    BYTE* data;
+    ULONGLONG offset;
+    OVERLAPPED ov;
+    HANDLE pendingOn;               // File with I/O in flight on this buffer
+} COPYBUFFER;
+
+static BOOL StartIo(HANDLE hFile, COPYBUFFER* buf, DWORD len, BOOL write) {
+    buf->ov.Offset = (DWORD)buf->offset;
+    buf->ov.OffsetHigh = (DWORD)(buf->offset >> 32);
+    ResetEvent(buf->ov.hEvent);
+    BOOL ok = write ? WriteFile(hFile, buf->data, len, NULL, &buf->ov) :
+        ReadFile(hFile, buf->data, len, NULL, &buf->ov);
+    if (ok || GetLastError() == ERROR_IO_PENDING) {
+        buf->pendingOn = hFile;
+        return TRUE;
+    }
+    return FALSE;
+}
+
+static BOOL FinishIo(HANDLE hFile, COPYBUFFER* buf, DWORD* bytes) {
+    buf->pendingOn = NULL;
+    return GetOverlappedResult(hFile, &buf->ov, bytes, TRUE);
+}
 
-static DWORD ExtractZip(const wchar_t* zipfile, const wchar_t* outdir) {
+// The copy goes to <dst>.partial, renamed to dst once complete. An 
+// interrupted copy is resumed from its checkpoint.
+static int CopyFileOverlapped(const wchar_t* src, const wchar_t* dst,
+        ULONGLONG* copied) {
     wchar_t msg[MAX_PATH + 30] = { 0 };
-    char zipfile_mb[256];
-    char outdir_mb[256];
-    int err = 0;
-    size_t output_size;
+    wchar_t partial[MAX_PATH] = { 0 };
+    wchar_t ckptPath[MAX_PATH] = { 0 };
+    CHECKPOINT ckpt, saved;
+    ULONGLONG remoteSize, remoteTime;
+    ULONGLONG start = 0;            // Where this attempt starts
+    ULONGLONG checkpointed = 0;
+    COPYBUFFER buf[2] = { 0 };
+    LARGE_INTEGER size = { 0 };
+    FILE_END_OF_FILE_INFO eof;
+    ULONGLONG lastTick = 0;
+    BOOL writing = FALSE;           // buf[!cur] has a write in flight
+    int cur = 0;
+    int retval = -1;
+
+    HANDLE hSrc = CreateFile(src, GENERIC_READ, FILE_SHARE_READ, NULL, 
+        OPEN_EXISTING, FILE_FLAG_OVERLAPPED | FILE_FLAG_NO_BUFFERING | 
+        FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+    if (hSrc == INVALID_HANDLE_VALUE) {
+        if (GetLastError() == ERROR_INVALID_PARAMETER)
+            return COPYNOTSUPPORTED;
+        AddMessage(L"ERROR", L"Cannot open source file");
+        return -1;
+    }
+    if (!GetFileSizeEx(hSrc, &size) || size.QuadPart <= 0) {
+        CloseHandle(hSrc);
+        AddMessage(L"ERROR", L"Source file is empty or unreadable");
+        return -1;
+    }
+    ULONGLONG total = (ULONGLONG)size.QuadPart;
+
+    wcscpy_s(partial, MAX_PATH, dst);
+    wcscat_s(partial, MAX_PATH, L".partial");
+    wcscpy_s(ckptPath, MAX_PATH, partial);
+    wcscat_s(ckptPath, MAX_PATH, L".ckpt");
+    if (GetFileSizeAndTime(src, &remoteSize, &remoteTime)) {
+        FillCheckpoint(&ckpt, src, total, remoteTime);
+        // Checkpoints fall on block boundaries, as unbuffered I/O needs
+        if (ReadCheckpoint(ckptPath, partial, &ckpt, &saved) &&
+                saved.bytesDone % COPYBLOCK == 0 && saved.bytesDone < total) {
+            start = saved.bytesDone;
+            checkpointed = start;
+            StringCchPrintf(msg, MAX_PATH + 30, 
+                L"Resuming download at %.1f MB", start / (1024.0 * 1024.0));
+            AddMessage(L"INFO", msg);
+        }
+    } else {
+        FillCheckpoint(&ckpt, src, total, 0);
+    }
+    if (start == 0)
+        DeleteFile(ckptPath);
+
+    HANDLE hDst = CreateFile(partial, GENERIC_WRITE, 0, NULL, 
+        start > 0 ? OPEN_EXISTING : CREATE_ALWAYS,
+        FILE_ATTRIBUTE_NORMAL | FILE_FLAG_OVERLAPPED | FILE_FLAG_NO_BUFFERING,
+        NULL);
+    if (hDst == INVALID_HANDLE_VALUE) {
+        DWORD error = GetLastError();
+        CloseHandle(hSrc);
+        if (error == ERROR_INVALID_PARAMETER)
+            return COPYNOTSUPPORTED;
+        wcscpy_s(msg, MAX_PATH + 30, L"Cannot create destination file ");
+        wcscat_s(msg, MAX_PATH + 30, partial);
+        AddMessage(L"ERROR", msg);
+        return -1;
+    }
+
+    // VirtualAlloc memory is page aligned, as unbuffered I/O requires
+    BYTE* memory = (BYTE*)VirtualAlloc(NULL, 2 * COPYBLOCK, 
+        MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+    buf[0].data = memory;
+    buf[1].data = memory + COPYBLOCK;
+    buf[0].ov.hEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+    buf[1].ov.hEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+    if (memory == NULL || buf[0].ov.hEvent == NULL || 
+            buf[1].ov.hEvent == NULL) {
+        AddMessage(L"ERROR", L"Memory allocation failed");
+        goto cleanup;
+    }
+
+    buf[cur].offset = start;
+    if (!StartIo(hSrc, &buf[cur], COPYBLOCK, FALSE))
+        goto fail;
+    for (;;) {
+        DWORD bytesRead = 0, bytesWritten = 0;
+        if (cancelInstall) {
+            // Like any other failure, the checkpoint is kept for next time
+            SetLastError(ERROR_CANCELLED);
+            goto fail;
+        }
+        if (!FinishIo(hSrc, &buf[cur], &bytesRead))
+            goto fail;
+        ULONGLONG end = buf[cur].offset + bytesRead;
+        // Unbuffered reads only come up short at the end of the file
+        if (bytesRead == 0 || (bytesRead < COPYBLOCK && end != total))
+            goto fail;
+
+        // The other buffer is free once its write has finished
+        if (writing) {
+            if (!FinishIo(hDst, &buf[!cur], &bytesWritten))
+                goto fail;
+            writing = FALSE;
+            // Everything in front of this block is now written
+            if (buf[cur].offset - checkpointed >= CHECKPOINTINTERVAL && 
+                    ckpt.remoteTime != 0) {
+                FlushFileBuffers(hDst);
+                ckpt.bytesDone = buf[cur].offset;
+                WriteCheckpoint(ckptPath, &ckpt);
+                checkpointed = ckpt.bytesDone;
+            }
+        }
+        if (end < total) {
+            buf[!cur].offset = end;
+            if (!StartIo(hSrc, &buf[!cur], COPYBLOCK, FALSE))
+                goto fail;
+        }
+
+        // Unbuffered writes must be whole sectors; the file is cut back 
+        // to size at the end
+        DWORD len = (bytesRead + SECTORALIGN - 1) & ~(SECTORALIGN - 1);
+        if (!StartIo(hDst, &buf[cur], len, TRUE))
+            goto fail;
+        writing = TRUE;
+        *copied = end - start;
+        ReportProgress(end, total, &lastTick);
+
+        if (end == total) {
+            if (!FinishIo(hDst, &buf[cur], &bytesWritten))
+                goto fail;
+            break;
+        }
+        cur = !cur;
+    }
+
+    eof.EndOfFile.QuadPart = (LONGLONG)total;
+    if (!SetFileInformationByHandle(hDst, FileEndOfFileInfo, &eof, 
+            sizeof(eof)))
+        goto fail;
+    retval = 0;
+    goto cleanup;
+
+fail:
+    StringCchPrintf(msg, MAX_PATH + 30, L"Copy failed (error %lu)", 
+        GetLastError());
+    // Buffers can't be freed while the kernel may still be using them
+    for (int i = 0; i < 2; i++) {
+        if (buf[i].pendingOn != NULL) {
+            DWORD bytes;
+            CancelIo(buf[i].pendingOn);
+            FinishIo(buf[i].pendingOn, &buf[i], &bytes);
+        }
+    }
+    AddMessage(L"ERROR", msg);
+cleanup:
+    for (int i = 0; i < 2; i++) {
+        if (buf[i].ov.hEvent != NULL)
+            CloseHandle(buf[i].ov.hEvent);
+    }
+    if (memory != NULL)
+        VirtualFree(memory, 0, MEM_RELEASE);
+    CloseHandle(hSrc);
+    CloseHandle(hDst);
+
+    // A failed copy leaves the partial file and checkpoint for next time
+    if (retval == 0) {
+        if (MoveFileEx(partial, dst, MOVEFILE_REPLACE_EXISTING)) {
+            DeleteFile(ckptPath);
+        } else {
+            wcscpy_s(msg, MAX_PATH + 30, L"Cannot create destination file ");
+            wcscat_s(msg, MAX_PATH + 30, dst);
+            AddMessage(L"ERROR", msg);
+            retval = -1;
+        }
+    }
+    return retval;
+}
+
+//============================================================================
+// Offload engine. CopyFileEx hands the whole copy to the system, which can
+// avoid moving the bytes through this process at all: a block clone on 
+// ReFS, ODX on SAN storage. Unbuffered, so a big zip doesn't push 
+// everything else out of the cache. It keeps no checkpoint, so it is only
+// used within one volume, which in practice means a --programdir on the 
+// local disk; downloads from the server are left to CopyFileOverlapped, 
+// which can resume them. A cache hit copies nothing at all.
+
+typedef struct {
+    ULONGLONG lastTick;
+} OFFLOADPROGRESS;
+
+static DWORD CALLBACK OffloadProgress(LARGE_INTEGER total, 
+        LARGE_INTEGER transferred, LARGE_INTEGER streamSize, 
+        LARGE_INTEGER streamTransferred, DWORD streamNumber, DWORD reason,
+        HANDLE hSrc, HANDLE hDst, LPVOID data) {
+    OFFLOADPROGRESS* progress = (OFFLOADPROGRESS*)data;
+    ReportProgress((ULONGLONG)transferred.QuadPart, 
+        (ULONGLONG)total.QuadPart, &progress->lastTick);
+    return cancelInstall ? PROGRESS_CANCEL : PROGRESS_CONTINUE;
+}
+
+static BOOL SameVolume(const wchar_t* src, const wchar_t* dst) {
+    wchar_t srcVolume[MAX_PATH] = { 0 };
+    wchar_t dstVolume[MAX_PATH] = { 0 };
+    return GetVolumePathName(src, srcVolume, MAX_PATH) && 
+        GetVolumePathName(dst, dstVolume, MAX_PATH) &&
+        _wcsicmp(srcVolume, dstVolume) == 0;
+}
+
+// Copies to <dst>.partial and renames it, as CopyFileOverlapped does. 
+// Returns COPYNOTSUPPORTED across volumes, or when the system copy fails 
+// other than by a cancel, for the other engines to try. A copy that left
+// a checkpoint goes straight to CopyFileOverlapped, which can resume it.
+static int CopyFileOffload(const wchar_t* src, const wchar_t* dst,
+        ULONGLONG* copied) {
+    wchar_t msg[MAX_PATH + 30] = { 0 };
+    wchar_t partial[MAX_PATH] = { 0 };
+    wchar_t ckptPath[MAX_PATH] = { 0 };
+    OFFLOADPROGRESS progress = { 0 };
+    ULONGLONG time;
+
+    wcscpy_s(partial, MAX_PATH, dst);
+    wcscat_s(partial, MAX_PATH, L".partial");
+    wcscpy_s(ckptPath, MAX_PATH, partial);
+    wcscat_s(ckptPath, MAX_PATH, L".ckpt");
+    if (!SameVolume(src, dst) || FileExists(ckptPath))
+        return COPYNOTSUPPORTED;
+
+    if (!CopyFileEx(src, partial, OffloadProgress, &progress, NULL, 
+            COPY_FILE_NO_BUFFERING)) {
+        DWORD error = GetLastError();
+        DeleteFile(partial);
+        if (error == ERROR_REQUEST_ABORTED && cancelInstall) {
+            AddMessage(L"INFO", L"Copy cancelled");
+            return -1;
+        }
+        if (DEBUG == TRUE) {
+            StringCchPrintf(msg, MAX_PATH + 30, 
+                L"CopyFileOffload: error %lu", error);
+            AddMessage(L"DEBUG", msg);
+        }
+        return COPYNOTSUPPORTED;
+    }
+    if (!MoveFileEx(partial, dst, MOVEFILE_REPLACE_EXISTING)) {
+        DeleteFile(partial);
+        wcscpy_s(msg, MAX_PATH + 30, L"Cannot create destination file ");
+        wcscat_s(msg, MAX_PATH + 30, dst);
+        AddMessage(L"ERROR", msg);
+        return -1;
+    }
+    GetFileSizeAndTime(dst, copied, &time);
+    InterlockedIncrement(&copiesOffloaded);
+    return 0;
+}
+
+//============================================================================
 
-    StringCchPrintf(msg, MAX_PATH+30, L"Extracting files from %s", zipfile);
+static void LogThroughput(const wchar_t* what, ULONGLONG bytes, 
+        double seconds) {
+    wchar_t msg[100] = { 0 };
+    double megabytes = bytes / (1024.0 * 1024.0);
+    StringCchPrintf(msg, 100, L"%s %.1f MB in %.2f s (%.1f MB/s)", what,
+        megabytes, seconds, seconds > 0 ? megabytes / seconds : 0.0);
     AddMessage(L"INFO", msg);
+}
 
-    wcstombs_s(&output_size, zipfile_mb, 256, zipfile, 256);
-    wcstombs_s(&output_size, outdir_mb, 256, outdir, 256);
+//============================================================================
 
-    struct zip* z = zip_open(zipfile_mb, 0, &err);
+// Runs on the install thread; takes ownership of params
+static int CopyFileWithProgress(COPYFILEPARAMS* params) {
+    wchar_t* src = params->src;
+    wchar_t* dst = params->dst;
+    ULONGLONG copied = 0;
+    LARGE_INTEGER start;
 
-    if (z == NULL) {
-        zip_error_t ziperror;
-        zip_error_init_with_code(&ziperror, err);
-        AddMessage(L"ERROR", L"Failed to open ZIP file");
-        zip_error_fini(&ziperror);
+    wchar_t msg[MAX_PATH + 50] = L"Downloading zip file from server: ";
+    wcscat_s(msg, MAX_PATH + 50, src);
+    AddMessage(L"INFO", msg);
+    ShowProgress(0);
+
+    // Each engine falls back to the next: the system's copy, then our own
+    // unbuffered one, then the 4 KB loop
+    QueryPerformanceCounter(&start);
+    const wchar_t* engine = L"Copied by CopyFileEx:";
+    int retval = CopyFileOffload(src, dst, &copied);
+    if (retval == COPYNOTSUPPORTED) {
+        engine = L"Copied unbuffered:";
+        retval = CopyFileOverlapped(src, dst, &copied);
+    }
+    if (retval == COPYNOTSUPPORTED) {
+        if (DEBUG == TRUE)
+            AddMessage(L"DEBUG", 
+                L"CopyFileWithProgress: Unbuffered I/O not supported");
+        engine = L"Copied by 4 KB loop:";
+        retval = CopyFileBuffered(src, dst, &copied);
+    }
+    if (retval == 0)
+        LogThroughput(engine, copied, ElapsedSeconds(&start));
+    InterlockedAdd64(&bytesCopied, (LONG64)copied);
+    TraceCall(L"CopyFileWithProgress", src, &start, retval == 0, copied, 1);
+
+    HideProgress();
+    free(params);
+    return retval;
+}
+
+//============================================================================
+// Deflate entries up to this size are read whole and inflated in one call,
+// which libdeflate does about twice as fast as zlib's incremental inflate. 
+// Larger ones are streamed. Every extraction thread keeps an in and an out
+// buffer of up to this size until the job ends, and the largest entries 
+// go first, so this is per thread: 16 threads hold 64 MB at most.
+#define ONESHOTMAX (2 * 1024 * 1024)
+
+static void InitInflater(INFLATER* inflater) {
+    memset(inflater, 0, sizeof(INFLATER));
+    inflater->decompressor = libdeflate_alloc_decompressor();
+}
+
+static void FreeInflater(INFLATER* inflater) {
+    if (inflater->decompressor != NULL)
+        libdeflate_free_decompressor(inflater->decompressor);
+    free(inflater->in);
+    free(inflater->out);
+}
+
+static BOOL GrowBuffer(BYTE** buffer, size_t* size, size_t needed) {
+    if (needed <= *size)
+        return TRUE;
+    BYTE* grown = (BYTE*)realloc(*buffer, needed);
+    if (grown == NULL)
+        return FALSE;
+    *buffer = grown;
+    *size = needed;
+    return TRUE;
+}
+
+// The whole of a deflate entry into inflater->out: its raw data is read 
+// in one go and inflated in one call, using the sizes from the central 
+// directory. FALSE for anything unusual, which is then left to libzip.
+static BOOL InflateEntry(INFLATER* inflater, zip_t* z, 
+        const EXTRACTENTRY* entry) {
+    size_t actual = 0;
+    zip_uint64_t got = 0;
+    zip_int64_t n;
+    if (inflater->decompressor == NULL || entry->method != ZIP_CM_DEFLATE ||
+            entry->size == 0 || entry->size > ONESHOTMAX || 
+            entry->compSize == 0 || entry->compSize > ONESHOTMAX) {
+        return FALSE;
+    }
+    if (!GrowBuffer(&inflater->in, &inflater->inSize, 
+            (size_t)entry->compSize) || 
+            !GrowBuffer(&inflater->out, &inflater->outSize, 
+            (size_t)entry->size)) {
+        return FALSE;
+    }
+    // Compressed: no decryption or decompression layer, just the bytes
+    zip_file_t* zf = zip_fopen_index(z, entry->index, ZIP_FL_COMPRESSED);
+    if (zf == NULL)
+        return FALSE;
+    while (got < entry->compSize && (n = zip_fread(zf, inflater->in + got,
+            entry->compSize - got)) > 0) {
+        got += n;
+    }
+    zip_fclose(zf);
+    if (got != entry->compSize)
+        return FALSE;
+    return libdeflate_deflate_decompress(inflater->decompressor, 
+        inflater->in, (size_t)entry->compSize, inflater->out, 
+        (size_t)entry->size, &actual) == LIBDEFLATE_SUCCESS && 
+        actual == entry->size;
+}
+
+//============================================================================
+// A STORE entry's data is the file, so it is copied straight out of the 
+// archive rather than through libzip: written in one call from a mapping 
+// of the zip. The mapping is set up once per archive by OpenStoredSource.
+
+// Set up archive for CopyStoredEntry. A stream may not have the data yet,
+// and a directory read by libzip has no offsets, so those are left out.
+static void OpenStoredSource(ARCHIVE* archive) {
+    LARGE_INTEGER size = { 0 };
+    SYSTEM_INFO si;
+
+    if (archive->stream != NULL || archive->names == NULL || 
+            archive->granularity != 0)
+        return;
+    GetSystemInfo(&si);
+    archive->granularity = si.dwAllocationGranularity;
+    if (archive->hMapping != NULL)
+        return;
+    HANDLE hFile = CreateFile(archive->path, GENERIC_READ, FILE_SHARE_READ,
+        NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (hFile == INVALID_HANDLE_VALUE)
+        return;
+    if (GetFileSizeEx(hFile, &size) && size.QuadPart > 0) {
+        archive->hMapping = CreateFileMapping(hFile, NULL, PAGE_READONLY, 
+            0, 0, NULL);
+        archive->size = (zip_uint64_t)size.QuadPart;
+    }
+    // The mapping keeps its own reference to the file
+    CloseHandle(hFile);
+}
+
+// Header and data of a local entry fit in this past its offset
+#define LOCALENTRYMAX (sizeof(local_file_header) + 2 * 65535)
+
+// Copy a STORE entry to outpath and CRC it from the mapping. FALSE for 
+// any other entry, or if the copy fails, which then goes through libzip.
+static BOOL CopyStoredEntry(const ARCHIVE* archive, 
+        const EXTRACTENTRY* entry, const wchar_t* outpath, 
+        zip_uint32_t* crc) {
+    local_file_header h;
+    const BYTE* base = archive->view;
+    const BYTE* view = NULL;
+    const BYTE* data = NULL;
+    ULONGLONG baseStart = 0;
+    ULONGLONG baseSize = archive->size;
+
+    if (archive->hMapping == NULL || entry->method != ZIP_CM_STORE || 
+            entry->offset == NOOFFSET || entry->size == 0 || 
+            entry->compSize != entry->size || entry->offset >= baseSize)
+        return FALSE;
+    if (base == NULL) {
+        // Just this entry, from the allocation boundary before it
+        baseStart = entry->offset - entry->offset % archive->granularity;
+        ULONGLONG end = entry->offset + LOCALENTRYMAX + entry->size;
+        baseSize = min(archive->size, end) - baseStart;
+        if (baseSize > (SIZE_T)-1)
+            return FALSE;
+        view = (const BYTE*)MapViewOfFile(archive->hMapping, FILE_MAP_READ,
+            (DWORD)(baseStart >> 32), (DWORD)baseStart, (SIZE_T)baseSize);
+        if (view == NULL)
+            return FALSE;
+        base = view;
+    }
+
+    // The local header's name and extra field can differ from the 
+    // central directory's, so the data offset comes from here
+    ULONGLONG at = entry->offset - baseStart;
+    if (baseSize - at >= sizeof(h)) {
+        memcpy(&h, base + at, sizeof(h));
+        at += sizeof(h) + (ULONGLONG)h.filename_length + h.extra_length;
+        if (h.signature == LOCALHEADERSIG && at <= baseSize && 
+                entry->size <= baseSize - at)
+            data = base + at;
+    }
+    BOOL ok = FALSE;
+    HANDLE hOut = INVALID_HANDLE_VALUE;
+    if (data != NULL) {
+        hOut = CreateFile(outpath, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, 
+            FILE_ATTRIBUTE_NORMAL, NULL);
+    }
+    if (hOut != INVALID_HANDLE_VALUE) {
+        ok = TRUE;
+        for (ULONGLONG done = 0; ok && done < entry->size; ) {
+            DWORD chunk = (DWORD)min(entry->size - done, 1 << 30);
+            DWORD written = 0;
+            ok = WriteFile(hOut, data + done, chunk, &written, NULL) && 
+                written == chunk;
+            done += chunk;
+        }
+        if (!CloseHandle(hOut))
+            ok = FALSE;
+        if (ok)
+            *crc = Crc32Update(0, data, (size_t)entry->size);
+    }
+    if (view != NULL)
+        UnmapViewOfFile(view);
+    return ok;
+}
+
+// Count an extracted entry, or report it if its size or CRC is wrong
+static int CheckExtracted(EXTRACTJOB* job, const EXTRACTENTRY* entry, 
+        const wchar_t* wname, zip_uint64_t total, zip_uint32_t crc) {
+    wchar_t msg[MAX_PATH + 30] = { 0 };
+
+    InterlockedAdd64(&bytesVerified, (LONG64)total);
+    if (total != entry->size || (entry->hasCrc && crc != entry->crc)) {
+        StringCchPrintf(msg, MAX_PATH + 30, L"CRC mismatch: %s", wname);
+        AddMessage(L"ERROR", msg);
+        InterlockedIncrement(&job->corrupt);
+        InterlockedIncrement(&crcFailures);
+        return -1;
+    }
+    InterlockedIncrement(&filesCreated);
+    InterlockedAdd64(&bytesExtracted, (LONG64)entry->size);
+    return 0;
+}
+
+//============================================================================
+// Extract a single entry of an open archive to outdir
+static int ExtractEntry(EXTRACTJOB* job, zip_t* z, INFLATER* inflater,
+        const EXTRACTENTRY* entry) {
+    wchar_t msg[MAX_PATH + 30] = { 0 };
+    zip_uint64_t i = entry->index;
+    const char* name = entry->name;
+
+    wchar_t wname[256];
+    if (!EntryNameToWide(name, -1, wname, 256) || wname[0] == L'\0') {
+        AddMessage(L"ERROR", L"Cannot convert a file name in the ZIP");
         return -1;
     }
 
-    zip_uint64_t num_entries = zip_get_num_entries(z, 0);
-    for (zip_uint64_t i = 0; i < num_entries; i++) {
-        const char* name = zip_get_name(z, i, 0);
-        if (name == NULL) {
-            AddMessage(L"ERROR", L"Failed to get name for entry");
+    wchar_t outpath[512];
+    swprintf(outpath, sizeof(outpath) / sizeof(wchar_t), L"%ls/%ls",
+        job->outdir, wname);
+
+    // Its directory was made by CreateExtractDirs
+    if (wname[wcslen(wname) - 1] == L'/') {
+        // This entry is a directory
+        return 0;
+    }
+    if (job->basedir != NULL) {
+        // Delta install: a file the installed version already has is 
+        // hard linked rather than extracted again
+        wchar_t basepath[512];
+        swprintf(basepath, sizeof(basepath) / sizeof(wchar_t), L"%ls/%ls",
+            job->basedir, wname);
+        if (FileMatchesEntry(basepath, entry) && 
+                CreateHardLink(outpath, basepath, NULL)) {
+            InterlockedIncrement(&job->unchanged);
+            InterlockedIncrement(&filesLinked);
+            return 0;
+        }
+    }
+    zip_uint32_t crc = 0;
+    if (CopyStoredEntry(job->archive, entry, outpath, &crc)) {
+        InterlockedIncrement(&filesStored);
+        return CheckExtracted(job, entry, wname, entry->size, crc);
+    }
+    BOOL inflated = InflateEntry(inflater, z, entry);
+    struct zip_file* zf = NULL;
+    if (!inflated) {
+        zf = zip_fopen_index(z, i, 0);
+        if (zf == NULL) {
+            AddMessage(L"ERROR", L"Failed to open file in ZIP");
+            return -1;
+        }
+    }
+
+    FILE* outf = _wfopen(outpath, L"wb");
+    if (outf == NULL) {
+        if (zf != NULL)
+            zip_fclose(zf);
+        wcscpy_s(msg, MAX_PATH + 30, L"Failed to open output file ");
+        wcscat_s(msg, MAX_PATH + 30, outpath);
+        AddMessage(L"ERROR", msg);
+        return -1;
+    }
+
+    // Each block is checked on its way to the file, while it is still in
+    // cache, rather than by reading the file back
+    char buffer[4096];
+    zip_int64_t bytes_read = 0;
+    zip_uint64_t total = 0;
+    BOOL written = TRUE;
+    if (inflated) {
+        total = entry->size;
+        crc = Crc32Update(crc, inflater->out, (size_t)total);
+        written = fwrite(inflater->out, 1, (size_t)total, outf) == total;
+        InterlockedIncrement(&filesInflated);
+    }
+    while (zf != NULL && 
+            (bytes_read = zip_fread(zf, buffer, sizeof(buffer))) > 0) {
+        if (fwrite(buffer, 1, bytes_read, outf) != (size_t)bytes_read)
+            written = FALSE;
+        crc = Crc32Update(crc, buffer, (size_t)bytes_read);
+        total += bytes_read;
+    }
+
+    if (fclose(outf) != 0) // Ensure the output file is closed
+        written = FALSE;
+    if (zf != NULL)
+        zip_fclose(zf); // Ensure the zip file entry is closed
+    if (bytes_read < 0 || !written) {
+        StringCchPrintf(msg, MAX_PATH + 30, L"Failed to extract %s", wname);
+        AddMessage(L"ERROR", msg);
+        return -1;
+    }
+    return CheckExtracted(job, entry, wname, total, crc);
+}
+
+//============================================================================
+// Pull entries off the shared queue until it is empty
+
+static void ExtractEntries(EXTRACTJOB* job, zip_t* z) {
+    INFLATER inflater;
+    LONG i;
+    InitInflater(&inflater);
+    while ((i = InterlockedIncrement(&job->next) - 1) < job->count) {
+        if (cancelInstall) {
+            InterlockedIncrement(&job->errors);
+            break;
+        }
+        if (ExtractEntry(job, z, &inflater, &job->entries[i]) != 0) {
+            InterlockedIncrement(&job->errors);
+        }
+    }
+    FreeInflater(&inflater);
+}
+
+static DWORD WINAPI ExtractWorker(LPVOID lpParam) {
+    EXTRACTJOB* job = (EXTRACTJOB*)lpParam;
+    int err = 0;
+
+    // libzip handles can't be shared between threads, so each worker 
+    // opens its own
+    zip_t* z = OpenArchive(job->archive, &err);
+    if (z == NULL) {
+        InterlockedIncrement(&job->errors);
+        return 1;
+    }
+    ExtractEntries(job, z);
+    zip_discard(z);
+    return 0;
+}
+
+// Largest entries first so that one big file doesn't end up as the tail
+static int CompareEntrySize(const void* a, const void* b) {
+    const EXTRACTENTRY* ea = (const EXTRACTENTRY*)a;
+    const EXTRACTENTRY* eb = (const EXTRACTENTRY*)b;
+    if (ea->size != eb->size)
+        return ea->size < eb->size ? 1 : -1;
+    return ea->index < eb->index ? -1 : (ea->index > eb->index);
+}
+
+//============================================================================
+// Worker threads come out of one pool for the whole process, so that 
+// installs running side by side in batch mode share the processors 
+// rather than each starting a full set of threads. A thread that hands 
+// out work always does some itself and doesn't count against the pool, 
+// so it never has to wait for a slot.
+
+static volatile LONG poolFree = 0;
+
+// Take up to wanted slots without waiting. Returns how many were taken.
+static int AcquireWorkers(int wanted) {
+    for (;;) {
+        LONG available = poolFree;
+        LONG taken = min(available, (LONG)wanted);
+        if (taken <= 0)
+            return 0;
+        if (InterlockedCompareExchange(&poolFree, available - taken, 
+                available) == available) {
+            return (int)taken;
+        }
+    }
+}
+
+static void ReleaseWorkers(int count) {
+    if (count > 0)
+        InterlockedExchangeAdd(&poolFree, count);
+}
+
+// Start up to count - 1 threads running proc; the caller is the other 
+// one. Returns the number started, which may be fewer if the pool is busy.
+static int StartWorkers(LPTHREAD_START_ROUTINE proc, void* param, int count,
+        HANDLE* threads) {
+    int wanted = AcquireWorkers(count - 1);
+    int started = 0;
+    for (int t = 0; t < wanted; t++) {
+        threads[started] = CreateThread(NULL, 0, proc, param, 0, NULL);
+        if (threads[started] != NULL)
+            started++;
+    }
+    ReleaseWorkers(wanted - started);
+    return started;
+}
+
+// Wait for worker threads to finish and give their slots back
+static void WaitForWorkers(HANDLE* threads, int count) {
+    if (count > 0)
+        WaitForMultipleObjects(count, threads, TRUE, INFINITE);
+    for (int i = 0; i < count; i++) {
+        CloseHandle(threads[i]);
+    }
+    ReleaseWorkers(count);
+}
+
+static int GetWorkerCount(int requested, LONG jobs) {
+    int count = requested;
+    if (count <= 0) {
+        SYSTEM_INFO si;
+        GetSystemInfo(&si);
+        count = (int)si.dwNumberOfProcessors;
+    }
+    if (count > MAXIMUM_WAIT_OBJECTS)
+        count = MAXIMUM_WAIT_OBJECTS;
+    if (count > jobs)
+        count = (int)jobs;
+    return count < 1 ? 1 : count;
+}
+
+//============================================================================
+// Create every directory the archive needs once, before any file is 
+// written, rather than walking the path of each entry as it is extracted.
+// Directories are created shallowest first by a pool of threads; one whose
+// parent isn't there yet (another thread is still making it) falls back 
+// to CreateDirectories.
+
+#define DIRSPERTHREAD 64
+
+static int CompareDirs(const void* a, const void* b) {
+    const EXTRACTDIR* da = (const EXTRACTDIR*)a;
+    const EXTRACTDIR* db = (const EXTRACTDIR*)b;
+    if (da->depth != db->depth)
+        return da->depth - db->depth;
+    if (da->len != db->len)
+        return da->len - db->len;
+    return memcmp(da->name, db->name, da->len);
+}
+
+static void CreateDirs(DIRJOB* job) {
+    wchar_t path[MAX_PATH + 1];
+    LONG i;
+
+    while ((i = InterlockedIncrement(&job->next) - 1) < job->count) {
+        const EXTRACTDIR* dir = &job->dirs[i];
+        size_t outlen = wcslen(job->outdir);
+        StringCchPrintf(path, MAX_PATH, L"%s\\", job->outdir);
+        // The name is a prefix of an entry name, so exactly len bytes are 
+        // converted; its length in characters can be less
+        if (outlen + 2 >= MAX_PATH || !EntryNameToWide(dir->name, 
+                (int)dir->len, path + outlen + 1, (int)(MAX_PATH - outlen - 1))
+                || path[outlen + 1] == L'\0') {
+            InterlockedIncrement(&job->errors);
+            continue;
+        }
+        for (wchar_t* c = path + outlen + 1; *c; c++) {
+            if (*c == L'/')
+                *c = L'\\';
+        }
+        InterlockedIncrement(&job->calls);
+        if (CreateDirectory(path, NULL) || 
+                GetLastError() == ERROR_ALREADY_EXISTS) {
             continue;
         }
+        // CreateDirectories drops the last component, so give it one
+        wcscat_s(path, MAX_PATH + 1, L"\\");
+        CreateDirectories(path, &job->calls);
+        path[wcslen(path) - 1] = L'\0';
+        InterlockedIncrement(&job->calls);
+        if (!DirectoryExists(path))
+            InterlockedIncrement(&job->errors);
+    }
+}
 
-        struct zip_stat st;
-        size_t output_size;
-        if (zip_stat_index(z, i, 0, &st) == 0) {
-            wchar_t wname[256];
-            mbstowcs_s(&output_size, wname, 256, name, 256);
-
-            wchar_t outpath[512];
-            swprintf(outpath, sizeof(outpath) / sizeof(wchar_t), L"%ls/%ls",
-                outdir, wname);
-
-            CreateDirectories(outpath);
-            if (wname[wcslen(wname) - 1] == L'/') {
-                // This entry is a directory
-                continue;
-            }
-            struct zip_file* zf = zip_fopen_index(z, i, 0);
-            if (zf == NULL) {
-                AddMessage(L"ERROR", L"Failed to open file in ZIP");
-                continue;
-            }
+static DWORD WINAPI CreateDirsWorker(LPVOID lpParam) {
+    CreateDirs((DIRJOB*)lpParam);
+    return 0;
+}
 
-            FILE* outf = _wfopen(outpath, L"wb");
-            if (outf == NULL) {
-                zip_fclose(zf);
-                wcscpy_s(msg, MAX_PATH + 30, L"Failed to open output file ");
-                wcscat_s(msg, MAX_PATH + 30, outpath);
-                AddMessage(L"ERROR", msg);
-                continue;
+static int CreateExtractDirs(const ARCHIVE* archive, const wchar_t* outdir) {
+    wchar_t msg[100] = { 0 };
+    wchar_t root[MAX_PATH + 1] = { 0 };
+    DIRJOB job = { 0 };
+    LONG perEntry = 0;          // Calls if each entry walked its own path
+    LONG prefixes = 0;
+    LONG outdirSeps = 0;
+
+    for (const wchar_t* c = outdir; *c; c++) {
+        if (*c == L'\\' || *c == L'/')
+            outdirSeps++;
+    }
+    // Every '/' in an entry name ends a directory it needs
+    for (LONG i = 0; i < archive->count; i++) {
+        LONG seps = 0;
+        for (const char* c = archive->entries[i].name; *c; c++) {
+            if (*c == '/')
+                seps++;
+        }
+        prefixes += seps;
+        perEntry += outdirSeps + seps + 1;
+    }
+    job.outdir = outdir;
+    job.dirs = (EXTRACTDIR*)malloc((prefixes + 1) * sizeof(EXTRACTDIR));
+    if (job.dirs == NULL) {
+        AddMessage(L"ERROR", L"Memory allocation failed");
+        return -1;
+    }
+    for (LONG i = 0; i < archive->count; i++) {
+        const char* name = archive->entries[i].name;
+        int depth = 0;
+        for (const char* c = name; *c; c++) {
+            if (*c == '/' && c > name) {
+                job.dirs[job.count].name = name;
+                job.dirs[job.count].len = (int)(c - name);
+                job.dirs[job.count].depth = depth++;
+                job.count++;
             }
+        }
+    }
+    qsort(job.dirs, job.count, sizeof(EXTRACTDIR), CompareDirs);
+    LONG unique = 0;
+    for (LONG i = 0; i < job.count; i++) {
+        if (unique == 0 || CompareDirs(&job.dirs[unique - 1], 
+                &job.dirs[i]) != 0) {
+            job.dirs[unique++] = job.dirs[i];
+        }
+    }
+    job.count = unique;
+
+    // outdir itself
+    StringCchPrintf(root, MAX_PATH + 1, L"%s\\", outdir);
+    CreateDirectories(root, &job.calls);
+
+    int workers = GetWorkerCount(EXTRACTTHREADS, job.count / DIRSPERTHREAD);
+    HANDLE threads[MAXIMUM_WAIT_OBJECTS];
+    int started = StartWorkers(CreateDirsWorker, &job, workers, threads);
+    CreateDirs(&job);
+    WaitForWorkers(threads, started);
+    free(job.dirs);
+
+    StringCchPrintf(msg, 100, 
+        L"%ld directories: %ld filesystem calls, was at least %ld", 
+        job.count, job.calls, perEntry);
+    AddMessage(L"INFO", msg);
+    if (job.errors > 0) {
+        StringCchPrintf(msg, 100, L"%ld directories could not be created",
+            job.errors);
+        AddMessage(L"ERROR", msg);
+        return -1;
+    }
+    return 0;
+}
 
-            char buffer[4096];
-            zip_int64_t bytes_read;
-            while ((bytes_read = zip_fread(zf, buffer, sizeof(buffer))) > 0) {
-                fwrite(buffer, 1, bytes_read, outf);
-            }
+//============================================================================
+
+// Extract archive to outdir. If it has a stream the zip is still arriving
+// and entries are extracted as their bytes come in. For a delta install 
+// basedir is the installed version, on the same volume as outdir.
+static DWORD ExtractZip(ARCHIVE* archive, const wchar_t* outdir,
+        const wchar_t* basedir) {
+    wchar_t msg[MAX_PATH + 30] = { 0 };
+    EXTRACTJOB job = { 0 };
+    STREAMFILE* stream = archive->stream;
+    ULONGLONG bytes = 0;
+    int err = 0;
+    LARGE_INTEGER start;
+    QueryPerformanceCounter(&start);
+
+    StringCchPrintf(msg, MAX_PATH + 30, L"Extracting files from %s", 
+        archive->path);
+    AddMessage(L"INFO", msg);
+
+    job.archive = archive;
+    job.outdir = outdir;
+
+    if (IndexArchive(archive) != 0) {
+        TraceCall(L"ExtractZip", outdir, &start, FALSE, 0, 0);
+        return -1;
+    }
+    // An index read natively leaves the handle to be opened here
+    if (archive->z == NULL)
+        archive->z = OpenArchive(archive, &err);
+    if (archive->z == NULL) {
+        AddMessage(L"ERROR", L"Failed to open ZIP file");
+        TraceCall(L"ExtractZip", outdir, &start, FALSE, 0, 0);
+        return -1;
+    }
+    zip_t* z = archive->z;
+    OpenStoredSource(archive);
+
+    // The work queue is the index, biggest first
+    job.entries = (EXTRACTENTRY*)malloc((archive->count + 1) * 
+            sizeof(EXTRACTENTRY));
+    if (job.entries == NULL) {
+        AddMessage(L"ERROR", L"Memory allocation failed");
+        TraceCall(L"ExtractZip", outdir, &start, FALSE, 0, 0);
+        return -1;
+    }
+    memcpy(job.entries, archive->entries, 
+        archive->count * sizeof(EXTRACTENTRY));
+    job.count = archive->count;
+    qsort(job.entries, job.count, sizeof(EXTRACTENTRY), CompareEntrySize);
+
+    if (DELTAINSTALL == TRUE && basedir != NULL && 
+            DirectoryExists((LPWSTR)basedir)) {
+        job.basedir = basedir;
+    }
+    // Entries whose directory is missing fail and are counted below
+    CreateExtractDirs(archive, outdir);
 
-            fclose(outf); // Ensure the output file is closed
-            zip_fclose(zf); // Ensure the zip file entry is closed
-        }
-        else {
-            AddMessage(L"ERROR", L"Failed to get file information");
-        }
+    // This thread works the queue as well, using the handle it already has
+    int workers = GetWorkerCount(EXTRACTTHREADS, job.count);
+    HANDLE threads[MAXIMUM_WAIT_OBJECTS];
+    int started = StartWorkers(ExtractWorker, &job, workers, threads);
+    if (DEBUG == TRUE) {
+        StringCchPrintf(msg, MAX_PATH + 30, 
+            L"ExtractZip: %ld entries, %d threads", job.count, started + 1);
+        AddMessage(L"DEBUG", msg);
     }
+    ExtractEntries(&job, z);
+    WaitForWorkers(threads, started);
+    free(job.entries);
 
-    if (zip_close(z) == 0 && DEBUG == TRUE) {
-        AddMessage(L"DEBUG", L"753 ExtractZip: zip_close succeeded");
+    if (job.errors > 0) {
+        StringCchPrintf(msg, MAX_PATH + 30, 
+            L"%ld entries could not be extracted", job.errors);
+        AddMessage(L"ERROR", msg);
     }
-    else {
-        if (DEBUG == TRUE)
-            AddMessage(L"DEBUG", L"755 ExtractZip: zip_close failed");
+    if (job.corrupt > 0) {
+        StringCchPrintf(msg, MAX_PATH + 30, 
+            L"%ld files failed the CRC check: the zip is damaged", 
+            job.corrupt);
+        AddMessage(L"ERROR", msg);
+    }
+    if (job.basedir != NULL) {
+        StringCchPrintf(msg, MAX_PATH + 30, 
+            L"Delta install: %ld unchanged, %ld written", 
+            job.unchanged, job.count - job.unchanged - job.errors);
+        AddMessage(L"INFO", msg);
     }
 
-    // Delete generally returns 0 which is a fail
-    if (FileExists(zipfile)) {
-        if (DeleteFile(zipfile) == 0 && DEBUG == TRUE) {
-            swprintf(msg, MAX_PATH + 20, L"Unable to delete %s", zipfile);
-            AddMessage(L"DEBUG", msg);
-        }
+    // Nothing left to read, but the transfer must be complete before the 
+    // zip can be cached or deleted
+    DWORD retval = 0;
+    if (job.corrupt > 0) {
+        archive->damaged = TRUE;
+        retval = -1;
     }
-    return 0;
+    if (stream != NULL && !WaitForStream(stream)) {
+        AddMessage(L"ERROR", L"Download of the zip file failed");
+        retval = -1;
+    }
+    for (LONG i = 0; i < archive->count; i++)
+        bytes += archive->entries[i].size;
+    TraceCall(L"ExtractZip", outdir, &start, retval == 0 && job.errors == 0,
+        bytes, job.count);
+    return retval;
 }
 
 //============================================================================
@@ -826,11 +4080,13 @@ static int RegisterApp(wchar_t* executablePath_orig, wchar_t* folderPath,
 
     AddMessage(L"INFO", L"Creating shortcut");
     wcscpy_s(executablePath, MAX_PATH, executablePath_orig);
-    if (SHGetSpecialFolderPath(NULL, shortcutPath, CSIDL_PROGRAMS, TRUE)) {
+    if (GetProgramsFolder(shortcutPath)) {
         // Append the app name to the path
         wcscat_s(shortcutPath, MAX_PATH, L"\\MyApps\\");
         wcscat_s(shortcutPath, MAX_PATH, shortcutName);
         wcscat_s(shortcutPath, MAX_PATH, L".lnk");
+        // Programs\MyApps may not exist yet
+        CreateDirectories(shortcutPath, NULL);
 
         // Eg: Change name from "GroupManager" to "Group Manager"
         if (!shortcutName) {
@@ -853,15 +4109,255 @@ static int RegisterApp(wchar_t* executablePath_orig, wchar_t* folderPath,
     return 0;
 }
 
+//============================================================================
+// Retired installs: the old version's directory is renamed aside so the 
+// new one can be installed straight away, and deleted once the new version
+// has been launched. The rename is within the same directory, so it is 
+// atomic and leaves nothing half deleted.
+
+#define MAXRETIRED 16
+
+static wchar_t RETIRED[MAXRETIRED][MAX_PATH];
+static int retiredCount = 0;
+static SRWLOCK retiredLock = SRWLOCK_INIT;     // Batch installs share it
+
+static void AddRetired(const wchar_t* path) {
+    AcquireSRWLockExclusive(&retiredLock);
+    for (int i = 0; i < retiredCount; i++) {
+        if (_wcsicmp(RETIRED[i], path) == 0) {
+            ReleaseSRWLockExclusive(&retiredLock);
+            return;
+        }
+    }
+    if (retiredCount < MAXRETIRED)
+        wcscpy_s(RETIRED[retiredCount++], MAX_PATH, path);
+    ReleaseSRWLockExclusive(&retiredLock);
+}
+
+// For a directory that has been renamed back
+static void ForgetRetired(const wchar_t* path) {
+    AcquireSRWLockExclusive(&retiredLock);
+    for (int i = 0; i < retiredCount; i++) {
+        if (_wcsicmp(RETIRED[i], path) == 0) {
+            retiredCount--;
+            wcscpy_s(RETIRED[i], MAX_PATH, RETIRED[retiredCount]);
+            break;
+        }
+    }
+    ReleaseSRWLockExclusive(&retiredLock);
+}
+
+// Returns FALSE if dir couldn't be renamed and must be deleted instead. 
+// If retiredPath is set it gets the new name.
+static BOOL RetireDirectory(const wchar_t* dir, wchar_t* retiredPath) {
+    WIN32_FIND_DATA findData;
+    wchar_t path[MAX_PATH] = { 0 };
+    wchar_t parent[MAX_PATH] = { 0 };
+    wchar_t retired[MAX_PATH] = { 0 };
+
+    wcscpy_s(path, MAX_PATH, dir);
+    if (path[wcslen(path) - 1] == L'\\')
+        path[wcslen(path) - 1] = L'\0';
+
+    // Leftovers from a run that ended before it could reclaim them
+    wcscpy_s(parent, MAX_PATH, path);
+    PathCchRemoveFileSpec(parent, MAX_PATH);
+    StringCchPrintf(retired, MAX_PATH, L"%s.old.*", path);
+    HANDLE hFind = FindFirstFile(retired, &findData);
+    if (hFind != INVALID_HANDLE_VALUE) {
+        do {
+            if (findData.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) {
+                StringCchPrintf(retired, MAX_PATH, L"%s\\%s", parent, 
+                    findData.cFileName);
+                AddRetired(retired);
+            }
+        } while (FindNextFile(hFind, &findData) != 0);
+        FindClose(hFind);
+    }
+
+    AcquireSRWLockShared(&retiredLock);
+    BOOL full = (retiredCount >= MAXRETIRED);
+    ReleaseSRWLockShared(&retiredLock);
+    if (full)
+        return FALSE;
+    StringCchPrintf(retired, MAX_PATH, L"%s.old.%llu", path, 
+        GetTickCount64());
+    if (!MoveFileEx(path, retired, 0))
+        return FALSE;
+    AddRetired(retired);
+    if (retiredPath != NULL)
+        wcscpy_s(retiredPath, MAX_PATH, retired);
+    if (DEBUG == TRUE) {
+        wchar_t msg[MAX_PATH + 30] = L"RetireDirectory: Renamed to ";
+        wcscat_s(msg, MAX_PATH + 30, retired);
+        AddMessage(L"DEBUG", msg);
+    }
+    return TRUE;
+}
+
+static void DeletePaths(DELETEJOB* job) {
+    LONG i;
+    while ((i = InterlockedIncrement(&job->next) - 1) < job->count) {
+        const wchar_t* path = job->paths[i];
+        DWORD attributes = GetFileAttributes(path);
+        if (attributes == INVALID_FILE_ATTRIBUTES)
+            continue;
+        if (attributes & FILE_ATTRIBUTE_DIRECTORY) {
+            DeleteDirectory(path);
+        } else if (DeleteFile(path)) {
+            InterlockedIncrement(&filesDeleted);
+        }
+    }
+}
+
+static DWORD WINAPI DeleteWorker(LPVOID lpParam) {
+    DeletePaths((DELETEJOB*)lpParam);
+    return 0;
+}
+
+// Delete the retired installs. Their top level entries are shared out 
+// between a pool of threads.
+static void ReclaimRetired(void) {
+    WIN32_FIND_DATA findData;
+    wchar_t searchPath[MAX_PATH];
+    wchar_t msg[MAX_PATH + 50] = { 0 };
+    DELETEJOB job = { 0 };
+    LONG capacity = 0;
+    LARGE_INTEGER start;
+
+    if (retiredCount == 0)
+        return;
+    QueryPerformanceCounter(&start);
+    LONG deletedBefore = filesDeleted;
+    for (int r = 0; r < retiredCount; r++) {
+        // Same guard as DeleteDirectoryContents
+        if (wcslen(RETIRED[r]) <= 20 || DirDepth(RETIRED[r]) <= 2) {
+            wcscpy_s(msg, MAX_PATH + 50, 
+                L"Please report: Aborting attempt to delete from ");
+            wcscat_s(msg, MAX_PATH + 50, RETIRED[r]);
+            AddMessage(L"ERROR", msg);
+            RETIRED[r][0] = L'\0';
+            continue;
+        }
+        swprintf(searchPath, MAX_PATH, L"%s\\*", RETIRED[r]);
+        HANDLE hFind = FindFirstFile(searchPath, &findData);
+        if (hFind == INVALID_HANDLE_VALUE)
+            continue;
+        do {
+            if (wcscmp(findData.cFileName, L".") == 0 ||
+                    wcscmp(findData.cFileName, L"..") == 0) {
+                continue;
+            }
+            if (job.count == capacity) {
+                LONG grown = capacity == 0 ? 64 : capacity * 2;
+                wchar_t (*paths)[MAX_PATH] = realloc(job.paths, 
+                    grown * sizeof(*paths));
+                if (paths == NULL)
+                    break;
+                job.paths = paths;
+                capacity = grown;
+            }
+            swprintf(job.paths[job.count++], MAX_PATH, L"%s\\%s", 
+                RETIRED[r], findData.cFileName);
+        } while (FindNextFile(hFind, &findData) != 0);
+        FindClose(hFind);
+    }
+
+    int workers = GetWorkerCount(EXTRACTTHREADS, job.count);
+    HANDLE threads[MAXIMUM_WAIT_OBJECTS];
+    int started = StartWorkers(DeleteWorker, &job, workers, threads);
+    DeletePaths(&job);
+    WaitForWorkers(threads, started);
+    free(job.paths);
+
+    for (int r = 0; r < retiredCount; r++) {
+        if (RETIRED[r][0] != L'\0')
+            RemoveDirectory(RETIRED[r]);
+    }
+    retiredCount = 0;
+    TraceCall(L"ReclaimRetired", L"", &start, TRUE, 0, 
+        filesDeleted - deletedBefore);
+    if (DEBUG == TRUE) {
+        StringCchPrintf(msg, MAX_PATH + 50, 
+            L"ReclaimRetired: %ld entries deleted in %.2f s with %d threads",
+            job.count, ElapsedSeconds(&start), started + 1);
+        AddMessage(L"DEBUG", msg);
+    }
+}
+
+//============================================================================
+// Staged install: the new version is extracted next to the live one, 
+// checked, and then swapped in with a rename.
+
+// Every file in the archive must be in stageDir at its full size
+static int VerifyStaging(const ARCHIVE* archive, const wchar_t* stageDir) {
+    wchar_t path[512];
+    wchar_t wname[256];
+    wchar_t msg[100] = { 0 };
+    ULONGLONG size, time;
+    LONG missing = 0;
+
+    if (archive->incomplete)
+        missing++;
+    for (LONG i = 0; i < archive->count; i++) {
+        const EXTRACTENTRY* entry = &archive->entries[i];
+        size_t len = strlen(entry->name);
+        if (len == 0 || entry->name[len - 1] == '/')
+            continue;
+        if (!EntryNameToWide(entry->name, (int)len, wname, 256)) {
+            missing++;
+            continue;
+        }
+        swprintf(path, sizeof(path) / sizeof(wchar_t), L"%ls/%ls", 
+            stageDir, wname);
+        if (!GetFileSizeAndTime(path, &size, &time) || size != entry->size)
+            missing++;
+    }
+    if (missing > 0) {
+        StringCchPrintf(msg, 100, 
+            L"New version is incomplete: %ld files missing or short", 
+            missing);
+        AddMessage(L"ERROR", msg);
+        return -1;
+    }
+    return 0;
+}
+
+// Replace liveDir with stageDir. The old version is retired, or put back
+// if the new one can't be moved into place.
+static int SwapInstall(const wchar_t* stageDir, const wchar_t* liveDir) {
+    wchar_t retiredPath[MAX_PATH] = { 0 };
+    BOOL retired = FALSE;
+    if (DirectoryExists((LPWSTR)liveDir)) {
+        retired = RetireDirectory(liveDir, retiredPath);
+        if (!retired) {
+            AddMessage(L"ERROR", 
+                L"Cannot move the installed version aside, is it in use?");
+            return -1;
+        }
+    }
+    if (!MoveFileEx(stageDir, liveDir, 0)) {
+        AddMessage(L"ERROR", L"Cannot move the new version into place");
+        if (retired && MoveFileEx(retiredPath, liveDir, 0))
+            ForgetRetired(retiredPath);
+        return -1;
+    }
+    return 0;
+}
+
 //============================================================================
 
-static void UninstallApplication(wchar_t* appName, wchar_t* folderName) {
+static void UninstallApplication(wchar_t* appName, wchar_t* folderName,
+        const wchar_t* keepDir) {
     // FolderName is MyOldApps for old installs, MyApps for new
-    // Remove shortcut and existing folder
+    // Remove shortcut and existing folder, unless the folder is under 
+    // keepDir (the live install, which SwapInstall has already replaced)
     wchar_t targetDir[MAX_PATH];
     wchar_t shortcutPath[MAX_PATH];
     size_t len = wcslen(appName) + 15;
     BOOL isDir = 0;
+    LARGE_INTEGER start;
+    QueryPerformanceCounter(&start);
 
     if (DEBUG == TRUE)
         AddMessage(L"DEBUG", L"878 UninstallApplication...");
@@ -874,9 +4370,17 @@ static void UninstallApplication(wchar_t* appName, wchar_t* folderName) {
         isDir = DirectoryExists(targetDir);
         // Expecting c:/Users/{username}/Appdata/Local/{ProgramName}  OR...
         //      c:/MyOldApps/{ProgramName}
-        if (wcslen(targetDir) > 20 && isDir) {
-            AddMessage(L"INFO", L"Deleting existing version...");
-            DeleteDirectory(targetDir);
+        if (keepDir != NULL && 
+                _wcsnicmp(targetDir, keepDir, wcslen(keepDir)) == 0) {
+            if (DEBUG == TRUE)
+                AddMessage(L"DEBUG", 
+                    L"UninstallApplication: Keeping the new version");
+        } else if (wcslen(targetDir) > 20 && isDir) {
+            // Deleted after the new version is running
+            if (!RetireDirectory(targetDir, NULL)) {
+                AddMessage(L"INFO", L"Deleting existing version...");
+                DeleteDirectory(targetDir);
+            }
         }
 		DeleteFile(shortcutPath);
         if (DEBUG == TRUE) {
@@ -889,6 +4393,7 @@ static void UninstallApplication(wchar_t* appName, wchar_t* folderName) {
         wcscat_s(msg, MAX_PATH+30, shortcutPath);
         AddMessage(L"DEBUG", msg);
     }
+    TraceCall(L"UninstallApplication", shortcutName, &start, TRUE, 0, 0);
 }
 
 //============================================================================
@@ -909,7 +4414,7 @@ static int GetInstaller(HWND hwnd, wchar_t* appdata) {
     wchar_t srcDir[MAX_PATH] = { 0 };
     wcscpy_s(srcDir, MAX_PATH, PROGRAMDIR);
     wcscat_s(srcDir, MAX_PATH, L"AppInstaller2");
-    wchar_t* remoteInstaller = GetNewestFileInDir(srcDir, L"\\*.zip");
+    wchar_t* remoteInstaller = GetReleaseFile(srcDir);
     if (remoteInstaller == NULL) {
         AddMessage(L"ERROR", L"Couldn't find remote installer");
         return -1;
@@ -924,9 +4429,19 @@ static int GetInstaller(HWND hwnd, wchar_t* appdata) {
     params->hwnd = hwnd;
     wcscpy_s(params->src, MAX_PATH, remoteInstaller);
     wcscpy_s(params->dst, MAX_PATH, localInstaller);
-    retval = CopyFileWithProgress(params);
+    if (CacheLookup(remoteInstaller, localInstaller)) {
+        free(params);
+    } else {
+        retval = CopyFileWithProgress(params);
+        if (retval == 0)
+            CacheStore(remoteInstaller, localInstaller);
+    }
     if (retval == 0) {
-        if (ExtractZip(localInstaller, localInstallerDir) != 0) {
+        ARCHIVE archive;
+        InitArchive(&archive, localInstaller, NULL);
+        int extracted = ExtractZip(&archive, localInstallerDir, NULL);
+        CloseArchive(&archive);
+        if (extracted != 0) {
             AddMessage(L"ERROR", L"Couldn't extract installer");
             return -1;
         }
@@ -963,7 +4478,7 @@ static int UpdateInstaller(HWND hwnd, wchar_t* appdata) {
         }
     } else {
         // Is AppInstaller.exe older than the zip on the network?
-        wchar_t* remoteInstaller = GetNewestFileInDir(srcDir, L"\\*.zip");
+        wchar_t* remoteInstaller = GetReleaseFile(srcDir);
         wchar_t* localInstaller = GetNewestFileInDir(localDir, L"\\*.exe");
         if (localInstaller == NULL) {
             return GetInstaller(hwnd, appdata);
@@ -991,6 +4506,174 @@ static int UpdateInstaller(HWND hwnd, wchar_t* appdata) {
     return 0;
 }
 
+//============================================================================
+// Time the copy engines, then the copy-then-extract path against the 
+// streaming path, for one zip.
+// Output goes to a scratch folder; the installed version is not touched.
+// Point --programdir at a cold share (or a local folder) for each run, as
+// whichever path goes second may be helped by the client-side cache.
+
+static void BenchmarkInstall(HWND hwnd, const wchar_t* zipFilename, 
+        const wchar_t* workDir) {
+    wchar_t benchZip[MAX_PATH] = { 0 };
+    wchar_t benchDir[MAX_PATH] = { 0 };
+    wchar_t msg[MAX_PATH + 50] = { 0 };
+    WIN32_FILE_ATTRIBUTE_DATA info;
+
+    if (!GetFileAttributesEx(zipFilename, GetFileExInfoStandard, &info)) {
+        AddMessage(L"ERROR", L"Cannot open source file");
+        return;
+    }
+    double megabytes = (((zip_uint64_t)info.nFileSizeHigh << 32) | 
+        info.nFileSizeLow) / (1024.0 * 1024.0);
+    wcscpy_s(benchZip, MAX_PATH, workDir);
+    wcscat_s(benchZip, MAX_PATH, L"Benchmark.zip");
+    wcscpy_s(benchDir, MAX_PATH, workDir);
+    wcscat_s(benchDir, MAX_PATH, L"Benchmark");
+
+    // Copy engines on their own
+    static const wchar_t* ENGINES[] = { L"4 KB buffered copy", 
+        L"Overlapped copy", L"CopyFileEx copy" };
+    for (int pass = 0; pass < 3; pass++) {
+        ULONGLONG copied = 0;
+        LARGE_INTEGER start;
+
+        ShowProgress(0);
+        QueryPerformanceCounter(&start);
+        int retval = pass == 0 ? 
+            CopyFileBuffered(zipFilename, benchZip, &copied) : pass == 1 ?
+            CopyFileOverlapped(zipFilename, benchZip, &copied) :
+            CopyFileOffload(zipFilename, benchZip, &copied);
+        double seconds = ElapsedSeconds(&start);
+        HideProgress();
+
+        StringCchPrintf(msg, MAX_PATH + 50, 
+            L"%s: %.2f s, %.1f MB/s%s", ENGINES[pass], 
+            seconds, seconds > 0 ? megabytes / seconds : 0.0,
+            retval == 0 ? L"" : retval == COPYNOTSUPPORTED ? 
+            L" (not used for this source)" : L" (FAILED)");
+        AddMessage(L"BENCH", msg);
+        DeleteFile(benchZip);
+    }
+
+    // Whole download and extract
+    for (int pass = 0; pass < 2; pass++) {
+        BOOL streaming = (pass == 1);
+        int retval = 0;
+        LARGE_INTEGER start;
+
+        if (DirectoryExists(benchDir))
+            DeleteDirectory(benchDir);
+        QueryPerformanceCounter(&start);
+        if (streaming) {
+            STREAMFILE* stream = StartStream(zipFilename, benchZip);
+            if (stream == NULL) {
+                retval = -1;
+            } else {
+                ARCHIVE archive;
+                InitArchive(&archive, benchZip, stream);
+                retval = ExtractZip(&archive, benchDir, NULL);
+                CloseArchive(&archive);
+            }
+            CloseStream(stream);
+        } else {
+            COPYFILEPARAMS* params = (COPYFILEPARAMS*)malloc(sizeof(
+                    COPYFILEPARAMS));
+            if (params == NULL) {
+                AddMessage(L"ERROR", L"Memory allocation failed");
+                return;
+            }
+            params->hwnd = hwnd;
+            wcscpy_s(params->src, MAX_PATH, zipFilename);
+            wcscpy_s(params->dst, MAX_PATH, benchZip);
+            retval = CopyFileWithProgress(params);
+            if (retval == 0) {
+                ARCHIVE archive;
+                InitArchive(&archive, benchZip, NULL);
+                retval = ExtractZip(&archive, benchDir, NULL);
+                CloseArchive(&archive);
+            }
+        }
+        double seconds = ElapsedSeconds(&start);
+
+        StringCchPrintf(msg, MAX_PATH + 50, 
+            L"%s: %.2f s, %.1f MB/s%s", 
+            streaming ? L"Streaming" : L"Copy then extract", seconds,
+            seconds > 0 ? megabytes / seconds : 0.0,
+            retval == 0 ? L"" : L" (FAILED)");
+        AddMessage(L"BENCH", msg);
+        DeleteFile(benchZip);
+    }
+
+    // Extraction alone from a local zip: read from the file, then mapped.
+    // CloseArchive deletes the zip when the cache is off, so keep it here.
+    BOOL useCache = USECACHE;
+    BOOL mapArchive = MAPARCHIVE;
+    USECACHE = TRUE;
+    if (CopyFile(zipFilename, benchZip, FALSE)) {
+        for (int pass = 0; pass < 2; pass++) {
+            ARCHIVE archive;
+            LARGE_INTEGER start;
+
+            if (DirectoryExists(benchDir))
+                DeleteDirectory(benchDir);
+            MAPARCHIVE = (pass == 1);
+            QueryPerformanceCounter(&start);
+            InitArchive(&archive, benchZip, NULL);
+            BOOL mapped = (archive.view != NULL);
+            int retval = ExtractZip(&archive, benchDir, NULL);
+            CloseArchive(&archive);
+            double seconds = ElapsedSeconds(&start);
+
+            StringCchPrintf(msg, MAX_PATH + 50, 
+                L"%s: %.2f s, %.1f MB/s%s", 
+                mapped ? L"Extract from mapping" : L"Extract from file", 
+                seconds, seconds > 0 ? megabytes / seconds : 0.0,
+                retval == 0 ? L"" : L" (FAILED)");
+            AddMessage(L"BENCH", msg);
+        }
+        DeleteFile(benchZip);
+    }
+    USECACHE = useCache;
+    MAPARCHIVE = mapArchive;
+    if (DirectoryExists(benchDir))
+        DeleteDirectory(benchDir);
+}
+
+//============================================================================
+
+//============================================================================
+// Everything an install needs before it starts on an application: the 
+// Worley folder in %LocalAppData% (returned in worleyDir), the download 
+// cache and, once per run, the installer's own update check.
+
+static BOOL installerChecked = FALSE;
+
+static int PrepareInstall(HWND hwnd, wchar_t* appdata, wchar_t* worleyDir) {
+    // Make sure Worley directory exists in %LocalAppData% 
+    wcscpy_s(worleyDir, MAX_PATH, appdata);
+    wcscat_s(worleyDir, MAX_PATH, L"\\Worley\\");
+    if (!DirectoryExists(worleyDir)) {
+        // Another install in the batch may have just made it
+        if (!SUCCEEDED(_wmkdir(worleyDir)) && !DirectoryExists(worleyDir)) {
+            AddMessage(L"ERROR", 
+                L"Unable to create 'Worley' directory in LocalAppData");
+            return -1;
+        }
+    }
+    // Batch mode does this before any of its install threads start
+    if (installerChecked == FALSE) {
+        LARGE_INTEGER start;
+        wcscpy_s(CACHEINDEX, MAX_PATH, worleyDir);
+        wcscat_s(CACHEINDEX, MAX_PATH, L"cache.ini");
+        QueryPerformanceCounter(&start);
+        int updated = UpdateInstaller(hwnd, appdata);
+        TraceCall(L"UpdateInstaller", appdata, &start, updated == 0, 0, 0);
+        installerChecked = TRUE;
+    }
+    return 0;
+}
+
 //============================================================================
 
 static int ProcessInstall(HWND hwnd, wchar_t* appName) {
@@ -1001,26 +4684,22 @@ static int ProcessInstall(HWND hwnd, wchar_t* appName) {
     wchar_t destFolderPath[MAX_PATH] = { 0 };
     wchar_t msg[75] = { 0 };
     wchar_t zipFilename[MAX_PATH] = { 0 };
-    if (SUCCEEDED(SHGetFolderPath(NULL, CSIDL_LOCAL_APPDATA, NULL, 0, appdata)))
+    wchar_t exePath[MAX_PATH] = { 0 };
+    LARGE_INTEGER installStart, stepStart;
+    QueryPerformanceCounter(&installStart);
+    if (GetLocalAppData(appdata))
     {
-        // Make sure Worley directory exists in %LocalAppData% 
         wchar_t localZipName[MAX_PATH];
-        wcscpy_s(localZipName, MAX_PATH, appdata);
-        wcscat_s(localZipName, MAX_PATH, L"\\Worley\\");
-        isDir = DirectoryExists(localZipName);
-        if (!isDir) {
-            if (!SUCCEEDED(_wmkdir(localZipName))) {
-                AddMessage(L"ERROR", 
-                    L"Unable to create 'Worley' directory in LocalAppData");
-                return -1;
-            }
-        }
-
         // STEP 1: Check / Install / Update Installer
-        UpdateInstaller(hwnd, appdata);
+        QueryPerformanceCounter(&stepStart);
+        retval = PrepareInstall(hwnd, appdata, localZipName);
+        LogStep(appName, L"prepare", retval == 0, &stepStart, 0);
+        if (retval != 0)
+            return -1;
 
         // -------------------------------------------------------------------
         // Get newest zip file from network program directory
+        QueryPerformanceCounter(&stepStart);
         wchar_t searchPath[MAX_PATH] = { 0 };
         wcscpy_s(searchPath, MAX_PATH, PROGRAMDIR);
         if (wcslen(appName) > 0) {
@@ -1032,16 +4711,27 @@ static int ProcessInstall(HWND hwnd, wchar_t* appName) {
                     appName);
                 AddMessage(L"ERROR", msg);
             } else {
-                wcscpy_s(zipFilename, MAX_PATH,
-                    GetNewestFileInDir(searchPath, L"\\*.zip"));
+                wchar_t* release = GetReleaseFile(searchPath);
+                if (release != NULL)
+                    wcscpy_s(zipFilename, MAX_PATH, release);
+                free(release);
             }
         }
         if (wcslen(appName) < 1) {
             AddMessage(L"ERROR", L"No application specified to install");
+            retval = INSTALL_NOAPP;
 		} else if (wcslen(zipFilename) < 1) {
             if (isDir)  // We found the directory but no zip files in it
                 AddMessage(L"ERROR", L"No zip files found");
+            LogStep(appName, L"find", FALSE, &stepStart, 0);
+            retval = INSTALL_NOTFOUND;
+        } else if (BENCHMARK == TRUE) {
+            BenchmarkInstall(hwnd, zipFilename, localZipName);
+            AddMessage(L"INFO", L"Finished!");
         } else {
+            ULONGLONG zipSize = 0, zipTime = 0, extractSize = 0;
+            LogStep(appName, L"find", TRUE, &stepStart, 0);
+            GetFileSizeAndTime(zipFilename, &zipSize, &zipTime);
             // ---------------------------------------------------------------
             // Copy file from server
             StringCchPrintf(msg, 75, L"Installing application %s", appName);
@@ -1052,82 +4742,367 @@ static int ProcessInstall(HWND hwnd, wchar_t* appName) {
             // We will make use of %LocalAppData%/MyApps/{appName}
             wcscpy_s(destFolderPath, MAX_PATH, localZipName);
             wcscat_s(localZipName, MAX_PATH, L".zip");
-            // TODO: don't copy if timestamps match
             if (FileExists(localZipName) && DEBUG == TRUE) {
                 AddMessage(L"DEBUG", L"1051 ProcessInstall: Local zip exists");
             } else if (DEBUG == TRUE) {
                 AddMessage(L"DEBUG", L"1053 ProcessInstall: Local zip not found");
                 AddMessage(L"DEBUG", localZipName);
             }
-            COPYFILEPARAMS* params = (COPYFILEPARAMS*)malloc(sizeof(
-                    COPYFILEPARAMS));
-            if (params == NULL) {
-                AddMessage(L"ERROR", L"Memory allocation failed");
-                return -1;
+            STREAMFILE* stream = NULL;
+            LARGE_INTEGER fetchStart;
+            QueryPerformanceCounter(&fetchStart);
+            BOOL cached = CacheLookup(zipFilename, localZipName);
+            if (cached) {
+                // STEP 2: Nothing to copy, the local zip is current
+                retval = 0;
+                LogStep(appName, L"fetch", TRUE, &fetchStart, 0);
+            } else if (STREAMINSTALL == TRUE) {
+                // STEP 2: Start pulling the file from the server. The rest
+                // of the install overlaps the transfer.
+                stream = StartStream(zipFilename, localZipName);
+                retval = (stream == NULL) ? -1 : 0;
+            } else {
+                COPYFILEPARAMS* params = (COPYFILEPARAMS*)malloc(sizeof(
+                        COPYFILEPARAMS));
+                if (params == NULL) {
+                    AddMessage(L"ERROR", L"Memory allocation failed");
+                    return -1;
+                }
+                params->hwnd = hwnd;
+                wcscpy_s(params->src, MAX_PATH, zipFilename);
+                wcscpy_s(params->dst, MAX_PATH, localZipName);
+                // STEP 2: Copy file from server
+                retval = CopyFileWithProgress(params);
+                if (retval == 0)
+                    CacheStore(zipFilename, localZipName);
+                LogStep(appName, L"fetch", retval == 0, &fetchStart, 
+                    retval == 0 ? zipSize : 0);
             }
-            params->hwnd = hwnd;
-            wcscpy_s(params->src, MAX_PATH, zipFilename);
-            wcscpy_s(params->dst, MAX_PATH, localZipName);
-            // STEP 2: Copy file from server
-            retval = CopyFileWithProgress(params);
+            // Indexed once, shared by the check and the extraction
+            ARCHIVE archive;
+            InitArchive(&archive, localZipName, stream);
             // ---------------------------------------------------------------
             // Is our program already runnning?
-            if (retval == 0)
-                retval = CheckIfRunning(localZipName);
+            if (retval == 0) {
+                QueryPerformanceCounter(&stepStart);
+                retval = CheckIfRunning(&archive);
+                LogStep(appName, L"check", retval == 0, &stepStart, 0);
+            }
             if (retval > 0)
                 AddMessage(L"ERROR", 
                         L"CANNOT INSTALL: the program is already running!");
             // ---------------------------------------------------------------
-            // Deregister existing version
+            // Extract new version next to the live one. Until it is 
+            // complete the installed version is left alone.
+            wchar_t stageDir[MAX_PATH] = { 0 };
+            wcscpy_s(stageDir, MAX_PATH, destFolderPath);
+            wcscat_s(stageDir, MAX_PATH, L".staging");
             if (retval == 0) {
-                wcscpy_s(searchPath, MAX_PATH, appdata);
-                wcscat_s(searchPath, MAX_PATH, L"\\MyApps\\");
-                wcscat_s(searchPath, MAX_PATH, appName);
-                // STEP 3: Uninstall existing version
-                // Also check if there is version in the MyOldApps directory
-                UninstallApplication(appName, L"MyOldApps");
-                UninstallApplication(appName, L"MyApps");
+                // STEP 3: Extract zip into the staging directory
+                // Left over from an install that didn't finish
+                if (DirectoryExists(stageDir) && 
+                        !RetireDirectory(stageDir, NULL))
+                    DeleteDirectory(stageDir);
+                QueryPerformanceCounter(&stepStart);
+                retval = ExtractZip(&archive, stageDir, destFolderPath);
+                for (LONG i = 0; i < archive.count; i++)
+                    extractSize += archive.entries[i].size;
+                LogStep(appName, L"extract", retval == 0, &stepStart, 
+                    extractSize);
+                // A stream is only complete once ExtractZip returns
+                if (stream != NULL) {
+                    if (retval == 0)
+                        CacheStore(zipFilename, localZipName);
+                    LogStep(appName, L"fetch", retval == 0, &fetchStart,
+                        retval == 0 ? zipSize : 0);
+                }
+                if (retval == 0) {
+                    QueryPerformanceCounter(&stepStart);
+                    retval = VerifyStaging(&archive, stageDir);
+                    LogStep(appName, L"verify", retval == 0, &stepStart, 0);
+                }
+                // The index already knows which executable was unzipped
+                if (retval == 0 && wcslen(archive.exeName) == 0) {
+                    AddMessage(L"ERROR", 
+                            L"1096 ProcessInstall: Did not find unzipped executable");
+                    retval = -1;
+                }
+                if (retval == 0 && cancelInstall) {
+                    // The last point at which the install can stop cleanly
+                    AddMessage(L"INFO", L"Install cancelled");
+                    retval = INSTALL_CANCELLED;
+                }
+                if (retval != 0 && DirectoryExists(stageDir) && 
+                        !RetireDirectory(stageDir, NULL)) {
+                    DeleteDirectory(stageDir);
+                }
             }
             // ---------------------------------------------------------------
-            // Extract new version
+            // Swap it in
             if (retval == 0) {
-                // STEP 4: Extract zip
-                retval = ExtractZip(localZipName, destFolderPath);
+                // STEP 4: Rename the new version into place
+                QueryPerformanceCounter(&stepStart);
+                retval = SwapInstall(stageDir, destFolderPath);
+                LogStep(appName, L"swap", retval == 0, &stepStart, 0);
             }
             // ---------------------------------------------------------------
-            // Create shortcut
+            // Deregister existing version
             if (retval == 0) {
-                wchar_t* newestFile = GetNewestFileInDir(searchPath, L"\\*.exe");
-				if (newestFile != NULL && wcslen(newestFile) > 0) {
-					wcscpy_s(exeFileName, MAX_PATH, newestFile);
-                    if (DEBUG == TRUE) {
-                        AddMessage(L"DEBUG", 
-                                L"1092 ProcessInstall: New unzipped executable:");
-                        AddMessage(L"DEBUG", newestFile);
-                    }
-                } else {
-                    AddMessage(L"ERROR", 
-                            L"1096 ProcessInstall: Did not find unzipped executable");
-                    if (DEBUG == TRUE)
-                        AddMessage(L"DEBUG", searchPath);
+                // STEP 5: Uninstall existing version
+                // Also check if there is version in the MyOldApps directory
+                QueryPerformanceCounter(&stepStart);
+                UninstallApplication(appName, L"MyOldApps", destFolderPath);
+                UninstallApplication(appName, L"MyApps", destFolderPath);
+                LogStep(appName, L"uninstall", TRUE, &stepStart, 0);
+
+                StringCchPrintf(exePath, MAX_PATH, L"%s\\%s", 
+                    destFolderPath, archive.exeName);
+                if (DEBUG == TRUE) {
+                    AddMessage(L"DEBUG", 
+                            L"1092 ProcessInstall: New unzipped executable:");
+                    AddMessage(L"DEBUG", exePath);
                 }
             }
-            if (exeFileName != NULL && wcslen(exeFileName) > 0) {
-                // STEP 5: Create shortcut
-                retval = RegisterApp(exeFileName, destFolderPath, appName);
+            CloseArchive(&archive);
+            CloseStream(stream);
+            // ---------------------------------------------------------------
+            // Create shortcut
+            if (retval == 0) {
+                // STEP 6: Point the shortcut at the new version
+                QueryPerformanceCounter(&stepStart);
+                retval = RegisterApp(exePath, destFolderPath, appName);
+                TraceCall(L"RegisterApp", exePath, &stepStart, retval == 0, 
+                    0, 1);
+                LogStep(appName, L"shortcut", retval == 0, &stepStart, 0);
             }
+            LogStep(appName, L"install", retval == 0, &installStart, zipSize);
 
-            if (retval == 0)
-                GOODTOLAUNCH = TRUE;
-            AddMessage(L"INFO", L"Finished!");
+            // A batch launches nothing; it reports when all are done
+            if (BATCH == FALSE) {
+                if (retval == 0) {
+                    wcscpy_s(exeFileName, MAX_PATH, exePath);
+                    GOODTOLAUNCH = TRUE;
+                }
+                AddMessage(L"INFO", L"Finished!");
+            }
         }
 	} else {
 		AddMessage(L"ERROR", L"Could not get LocalAppData directory");
-        return 0;
+        return -1;
 	}
+    if (retval < 0 && cancelInstall)
+        retval = INSTALL_CANCELLED;
+    return retval;
+}
+
+//============================================================================
+// Batch mode: several applications, from the command line or a manifest,
+// installed by a few threads at once. Their extraction threads share the 
+// worker pool, so the whole batch stays within one set of threads.
+
+#define BATCHINSTALLS 4         // Applications installed at once
+
+static BATCHJOB batchJob = { 0 };
+
+static void AddBatchApp(const wchar_t* appName) {
+    if (wcslen(appName) == 0)
+        return;
+    for (LONG i = 0; i < batchJob.count; i++) {
+        if (_wcsicmp(batchJob.apps[i], appName) == 0)
+            return;
+    }
+    if (batchJob.count < MAXBATCH) {
+        wcscpy_s(batchJob.apps[batchJob.count++], MAX_PATH, appName);
+    } else {
+        AddMessage(L"ERROR", L"Too many applications, ignoring the rest");
+    }
+}
+
+// One application name per line. Blank lines and lines starting with 
+// '#' or ';' are skipped.
+static int ReadManifest(const wchar_t* path) {
+    wchar_t line[MAX_PATH] = { 0 };
+    FILE* manifest = _wfopen(path, L"rt, ccs=UTF-8");
+    if (manifest == NULL) {
+        wchar_t msg[MAX_PATH + 30] = L"Cannot open manifest ";
+        wcscat_s(msg, MAX_PATH + 30, path);
+        AddMessage(L"ERROR", msg);
+        return -1;
+    }
+    while (fgetws(line, MAX_PATH, manifest) != NULL) {
+        wchar_t* start = line;
+        while (iswspace(*start))
+            start++;
+        size_t len = wcslen(start);
+        while (len > 0 && iswspace(start[len - 1]))
+            start[--len] = L'\0';
+        if (len > 0 && start[0] != L'#' && start[0] != L';')
+            AddBatchApp(start);
+    }
+    fclose(manifest);
+    return 0;
+}
+
+static DWORD WINAPI BatchWorker(LPVOID lpParam) {
+    BATCHJOB* job = (BATCHJOB*)lpParam;
+    wchar_t msg[MAX_PATH + 30] = { 0 };
+    LONG i;
+
+    while (!cancelInstall && 
+            (i = InterlockedIncrement(&job->next) - 1) < job->count) {
+        if (ProcessInstall(job->hwnd, job->apps[i]) == 0) {
+            StringCchPrintf(msg, MAX_PATH + 30, L"Installed %s", 
+                job->apps[i]);
+            AddMessage(L"INFO", msg);
+        } else {
+            InterlockedIncrement(&job->failed);
+            StringCchPrintf(msg, MAX_PATH + 30, L"Failed to install %s", 
+                job->apps[i]);
+            AddMessage(L"ERROR", msg);
+        }
+    }
+    return 0;
+}
+
+// Runs on the install thread, which only waits while the installs run
+static int RunBatch(HWND hwnd) {
+    wchar_t appdata[MAX_PATH];
+    wchar_t worleyDir[MAX_PATH];
+    wchar_t msg[100] = { 0 };
+    HANDLE threads[BATCHINSTALLS];
+    LARGE_INTEGER start;
+
+    QueryPerformanceCounter(&start);
+    batchJob.hwnd = hwnd;
+    StringCchPrintf(msg, 100, L"Installing %ld applications", 
+        batchJob.count);
+    AddMessage(L"INFO", msg);
+    if (!GetLocalAppData(appdata)) {
+        AddMessage(L"ERROR", L"Could not get LocalAppData directory");
+        return -1;
+    }
+    // STEP 1, once for the whole batch
+    if (PrepareInstall(hwnd, appdata, worleyDir) != 0)
+        return -1;
+
+    // The install threads come out of the pool too
+    int wanted = AcquireWorkers(min(batchJob.count, BATCHINSTALLS));
+    int started = 0;
+    for (int t = 0; t < wanted; t++) {
+        threads[started] = CreateThread(NULL, 0, BatchWorker, &batchJob, 0,
+                NULL);
+        if (threads[started] != NULL)
+            started++;
+    }
+    ReleaseWorkers(wanted - started);
+    if (started == 0) {
+        // No threads to be had: do them one at a time here
+        BatchWorker(&batchJob);
+    }
+    WaitForWorkers(threads, started);
+
+    StringCchPrintf(msg, 100, 
+        L"Finished! %ld of %ld applications installed in %.1f s", 
+        batchJob.count - batchJob.failed, batchJob.count, 
+        ElapsedSeconds(&start));
+    AddMessage(L"INFO", msg);
+    if (cancelInstall)
+        return INSTALL_CANCELLED;
+    return batchJob.failed > 0 ? -1 : 0;
+}
+
+//============================================================================
+// The run itself, whatever it was asked to do: publish, a batch or a single
+// install. Returns a ProcessInstall result.
+
+static int RunInstall(HWND hwnd, const wchar_t* manifest) {
+    wchar_t appName[MAX_PATH] = { 0 };
+    int retval = 0;
+
+    if (wcslen(manifest) > 0 && ReadManifest(manifest) != 0)
+        return INSTALL_NOAPP;
+    BATCH = (wcslen(manifest) > 0 || batchJob.count > 1);
+    if (batchJob.count > 0)
+        wcscpy_s(appName, MAX_PATH, batchJob.apps[0]);
+    if (PUBLISH == TRUE) {
+        wchar_t folder[MAX_PATH] = { 0 };
+        if (wcslen(appName) < 1) {
+            AddMessage(L"ERROR", L"No application specified to publish");
+            return INSTALL_NOAPP;
+        }
+        if (RECOMPRESS == BADMETHOD) {
+            AddMessage(L"ERROR", L"Unknown compression method: use store, "
+                L"deflate, bzip2, lzma, zstd or xz");
+            return INSTALL_NOAPP;
+        }
+        StringCchPrintf(folder, MAX_PATH, L"%s%s", PROGRAMDIR, appName);
+        if (!DirectoryExists(folder)) {
+            AddMessage(L"ERROR", L"Could not find the application folder");
+            return INSTALL_NOTFOUND;
+        }
+        retval = PublishRelease(folder);
+        AddMessage(L"INFO", L"Finished!");
+    } else if (BATCH == TRUE) {
+        retval = RunBatch(hwnd);
+    } else {
+        retval = ProcessInstall(hwnd, appName);
+    }
+    return retval;
+}
+
+// The install thread of a window run
+static DWORD WINAPI InstallThreadProc(LPVOID lpParam) {
+    int result = RunInstall(hwndMain, (const wchar_t*)lpParam);
+    PostMessage(hwndMain, WM_INSTALLDONE, (WPARAM)result, 0);
     return 0;
 }
 
+static int ExitCode(int result) {
+    switch (result) {
+    case 0:
+        return EXIT_SUCCESS;
+    case INSTALL_RUNNING:
+        return EXIT_RUNNING;
+    case INSTALL_NOTFOUND:
+        return EXIT_NOTFOUND;
+    case INSTALL_NOAPP:
+        return EXIT_USAGE;
+    case INSTALL_CANCELLED:
+        return EXIT_CANCELLED;
+    default:
+        return EXIT_FAILED;
+    }
+}
+
+// Ctrl+C or Ctrl+Break stops a headless install as a cancel would
+static BOOL WINAPI ConsoleCtrlHandler(DWORD ctrlType) {
+    if (ctrlType == CTRL_C_EVENT || ctrlType == CTRL_BREAK_EVENT) {
+        InterlockedExchange(&cancelInstall, 1);
+        return TRUE;
+    }
+    return FALSE;
+}
+
+// No window and no message loop: log events go to stdout, nothing is 
+// launched, and the exit code says how it went.
+static int RunHeadless(const wchar_t* manifest) {
+    wchar_t fields[50];
+
+    OpenEventStream();
+    SetConsoleCtrlHandler(ConsoleCtrlHandler, TRUE);
+    EmitEvent(L"start", L"");
+    int exitCode = ExitCode(RunInstall(NULL, manifest));
+    // Nothing is launched, so the old version can go straight away
+    ReclaimRetired();
+    WriteProfile();
+    StringCchPrintf(fields, 50, L"\"exit\":%d", exitCode);
+    EmitEvent(L"end", fields);
+    CloseEventStream();
+    if (wcslen(LOGFILE) > 0)
+        WriteLogFile(LOGFILE);
+    return exitCode;
+}
+
 //============================================================================
 // GUI Functions
 //============================================================================
@@ -1162,13 +5137,11 @@ static void DrawColumnLines(HWND hwnd) {
 
 //============================================================================
 
-static void CopyListViewToClipboard() {
-    int rowCount = ListView_GetItemCount(hListView);
-    int colCount = Header_GetItemCount(ListView_GetHeader(hListView));
-
-    // Calculate the buffer size needed
-    int bufferSize = (rowCount * (256 + 30)) * colCount;
-    HGLOBAL hMem = GlobalAlloc(GMEM_MOVEABLE, bufferSize);
+// The whole log, not just the rows in view. Sized first, so the buffer is
+// allocated once and filled in a single pass.
+static void CopyLogToClipboard(void) {
+    size_t length = LogTextLength();
+    HGLOBAL hMem = GlobalAlloc(GMEM_MOVEABLE, (length + 1) * sizeof(wchar_t));
     if (!hMem) return;
 
     // Lock the global memory object
@@ -1177,21 +5150,7 @@ static void CopyListViewToClipboard() {
         GlobalFree(hMem);
         return;
     }
-
-    buffer[0] = L'\0';
-
-    // Copy the ListView content to the buffer
-    for (int i = 0; i < rowCount; i++) {
-        for (int j = 0; j < colCount; j++) {
-            wchar_t text[256] = { 0 };
-            int x = sizeof(text) / sizeof(wchar_t);
-            ListView_GetItemText(hListView, i, j, text, x);
-            wcscat_s(buffer, bufferSize / sizeof(wchar_t), text);
-            if (j < colCount - 1) wcscat_s(buffer, bufferSize /
-                sizeof(wchar_t), L"\t");
-        }
-        wcscat_s(buffer, bufferSize / sizeof(wchar_t), L"\r\n");
-    }
+    FormatLogText(buffer);
 
     // Unlock the global memory object
     GlobalUnlock(hMem);
@@ -1213,7 +5172,41 @@ LRESULT CALLBACK WindowProc(HWND hwnd, UINT uMsg, WPARAM wParam, LPARAM lParam)
     switch (uMsg) {
     case WM_CREATE:
         AddControls(hwnd);
+        SetTimer(hwnd, IDT_LOGDRAIN, LOGDRAININTERVAL, NULL);
+        break;
+    case WM_TIMER:
+        if (wParam == IDT_LOGDRAIN)
+            DrainLog();
+        break;
+    case WM_PROGRESS:
+        if (wParam == PROGRESSHIDE) {
+            ShowWindow(hwndProgressBar, SW_HIDE);
+        } else {
+            SendMessage(hwndProgressBar, PBM_SETPOS, wParam, 0);
+            ShowWindow(hwndProgressBar, SW_SHOW);
+        }
+        break;
+    case WM_INSTALLDONE:
+        WaitForSingleObject(hInstallThread, INFINITE);
+        CloseHandle(hInstallThread);
+        hInstallThread = NULL;
+        DrainLog();
+        ShowWindow(hwndProgressBar, SW_HIDE);
+        SetWindowText(hExitButton, L"Close");
+        EnableWindow(hExitButton, TRUE);
+        if (closeWhenDone)
+            DestroyWindow(hwnd);
         break;
+    case WM_CLOSE:
+        if (hInstallThread != NULL) {
+            // Stop the install first; the window goes when it has
+            InterlockedExchange(&cancelInstall, 1);
+            closeWhenDone = TRUE;
+            EnableWindow(hExitButton, FALSE);
+            AddMessage(L"INFO", L"Cancelling...");
+            return 0;
+        }
+        return DefWindowProc(hwnd, uMsg, wParam, lParam);
     case WM_SIZE:
         if (hListView != NULL && hExitButton != NULL && hCopyButton != NULL) {
             int windowWidth = LOWORD(lParam);
@@ -1281,17 +5274,27 @@ LRESULT CALLBACK WindowProc(HWND hwnd, UINT uMsg, WPARAM wParam, LPARAM lParam)
         return hit;
     }
     case WM_COMMAND:
-        if (LOWORD(wParam) == IDC_EXIT_BUTTON) {
-            // STEP 6: Start new application on Exit
+        if (LOWORD(wParam) == IDC_EXIT_BUTTON && hInstallThread != NULL) {
+            InterlockedExchange(&cancelInstall, 1);
+            EnableWindow(hExitButton, FALSE);
+            AddMessage(L"INFO", L"Cancelling...");
+        } else if (LOWORD(wParam) == IDC_EXIT_BUTTON) {
+            // STEP 7: Start new application on Exit
             if (GOODTOLAUNCH == TRUE)
                 ExecuteProgram(exeFileName);
             PostQuitMessage(0);
         }
         else if (LOWORD(wParam) == IDC_COPY_BUTTON) {
-            CopyListViewToClipboard(hListView);
+            CopyLogToClipboard();
         }
         break;
+    case WM_NOTIFY:
+        if (((NMHDR*)lParam)->hwndFrom == hListView && 
+                ((NMHDR*)lParam)->code == LVN_GETDISPINFO)
+            GetLogDispInfo(&((NMLVDISPINFO*)lParam)->item);
+        break;
     case WM_DESTROY:
+        hListView = NULL;
         PostQuitMessage(0);
         return 0;
     default:
@@ -1307,7 +5310,7 @@ void AddControls(HWND hwnd) {
 
     hListView = CreateWindowExW(
         WS_EX_CLIENTEDGE, WC_LISTVIEWW, NULL,
-        WS_CHILD | WS_VISIBLE | LVS_REPORT | LVS_AUTOARRANGE,
+        WS_CHILD | WS_VISIBLE | LVS_REPORT | LVS_AUTOARRANGE | LVS_OWNERDATA,
         10, 10, 768, 350,
         hwnd, (HMENU)IDC_LISTVIEW, GetModuleHandle(NULL), NULL
     );
@@ -1385,26 +5388,71 @@ int WINAPI wWinMain(_In_ HINSTANCE hInstance, _In_opt_ HINSTANCE hPrevInstance,
     wc.lpszClassName = CLASS_NAME;
     wc.hbrBackground = CreateSolidBrush(RGB(240, 240, 240));
     setlocale(LC_ALL, "");
+    InitLog();
 
     RegisterClass(&wc);
 
-    /*
     // Parse command line arguments
     int argc;
-    wchar_t* appName = { 0 };
+    wchar_t manifest[MAX_PATH] = { 0 };
     LPWSTR* argv = CommandLineToArgvW(GetCommandLineW(), &argc);
     if (argv != NULL) {
-        for (int i = 0; i < argc; i++) {
+        for (int i = 1; i < argc; i++) {
             if (wcscmp(argv[i], L"--debug") == 0) {
                 DEBUG = TRUE;
-            } else if (i > 0 && DEBUG == FALSE) {
-                appName = argv[i];
+            } else if (wcscmp(argv[i], L"--threads") == 0 && i + 1 < argc) {
+                EXTRACTTHREADS = _wtoi(argv[++i]);
+            } else if (wcscmp(argv[i], L"--programdir") == 0 && 
+                    i + 1 < argc) {
+                wcscpy_s(PROGRAMDIR, MAX_PATH, argv[++i]);
+                if (PROGRAMDIR[wcslen(PROGRAMDIR) - 1] != L'\\')
+                    wcscat_s(PROGRAMDIR, MAX_PATH, L"\\");
+            } else if (wcscmp(argv[i], L"--no-stream") == 0) {
+                STREAMINSTALL = FALSE;
+            } else if (wcscmp(argv[i], L"--delta") == 0) {
+                DELTAINSTALL = TRUE;
+            } else if (wcscmp(argv[i], L"--no-cache") == 0) {
+                USECACHE = FALSE;
+            } else if (wcscmp(argv[i], L"--verify-cache") == 0) {
+                VERIFYCACHE = TRUE;
+            } else if (wcscmp(argv[i], L"--map") == 0) {
+                MAPARCHIVE = TRUE;
+            } else if (wcscmp(argv[i], L"--batch") == 0 && i + 1 < argc) {
+                wcscpy_s(manifest, MAX_PATH, argv[++i]);
+            } else if (wcscmp(argv[i], L"--publish") == 0) {
+                PUBLISH = TRUE;
+            } else if (wcscmp(argv[i], L"--recompress") == 0 && 
+                    i + 1 < argc) {
+                RECOMPRESS = ParseMethod(argv[++i]);
+                if (RECOMPRESS < 0)
+                    RECOMPRESS = BADMETHOD;
+            } else if (wcscmp(argv[i], L"--benchmark") == 0) {
+                BENCHMARK = TRUE;
+            } else if (wcscmp(argv[i], L"--stats") == 0 && i + 1 < argc) {
+                wcscpy_s(STATSFILE, MAX_PATH, argv[++i]);
+                TRACING = TRUE;
+            } else if (wcscmp(argv[i], L"--trace") == 0 && i + 1 < argc) {
+                wcscpy_s(TRACEFILE, MAX_PATH, argv[++i]);
+                TRACING = TRUE;
+            } else if (wcscmp(argv[i], L"--log") == 0 && i + 1 < argc) {
+                wcscpy_s(LOGFILE, MAX_PATH, argv[++i]);
+            } else if (wcscmp(argv[i], L"--headless") == 0) {
+                HEADLESS = TRUE;
+            } else if (wcscmp(argv[i], L"--appdata") == 0 && i + 1 < argc) {
+                wcscpy_s(APPDATA, MAX_PATH, argv[++i]);
+                size_t len = wcslen(APPDATA);
+                if (len > 0 && APPDATA[len - 1] == L'\\')
+                    APPDATA[len - 1] = L'\0';
+            } else {
+                AddBatchApp(argv[i]);
             }
         }
+        // Free the memory allocated for CommandLineToArgvW
+        LocalFree(argv);
     }
-    // Free the memory allocated for CommandLineToArgvW
-    LocalFree(argv);
-    */
+    poolFree = GetWorkerCount(EXTRACTTHREADS, MAXIMUM_WAIT_OBJECTS);
+    if (HEADLESS == TRUE)
+        return RunHeadless(manifest);
 
     HWND hwnd = CreateWindowExW(
         0,                              // Optional window styles.
@@ -1428,11 +5476,18 @@ int WINAPI wWinMain(_In_ HINSTANCE hInstance, _In_opt_ HINSTANCE hPrevInstance,
         SendMessage(hwnd, WM_SETICON, ICON_SMALL, (LPARAM)hIcon);
     }
 
+    hwndMain = hwnd;
     ShowWindow(hwnd, nCmdShow);
 
-    // Here is where the magic happens:
-    ProcessInstall(hwnd, lpCmdLine);
-
+    // Here is where the magic happens, on its own thread. The window only
+    // shows what it posts back, and the button cancels it until it is done.
+    hInstallThread = CreateThread(NULL, 0, InstallThreadProc, manifest, 0, 
+        NULL);
+    if (hInstallThread != NULL) {
+        SetWindowText(hExitButton, L"Cancel");
+    } else {
+        AddMessage(L"ERROR", L"Unable to start install thread");
+    }
     EnableWindow(hExitButton, TRUE);
 
     MSG msg = { 0 };
@@ -1440,6 +5495,19 @@ int WINAPI wWinMain(_In_ HINSTANCE hInstance, _In_opt_ HINSTANCE hPrevInstance,
         TranslateMessage(&msg);
         DispatchMessage(&msg);
     }
+
+    // The new version has been started; clear up the old one out of sight
+    ShowWindow(hwnd, SW_HIDE);
+    if (hInstallThread != NULL) {
+        InterlockedExchange(&cancelInstall, 1);
+        WaitForSingleObject(hInstallThread, INFINITE);
+        CloseHandle(hInstallThread);
+    }
+    ReclaimRetired();
+    WriteProfile();
+    DrainLog();
+    if (wcslen(LOGFILE) > 0)
+        WriteLogFile(LOGFILE);
     return EXIT_SUCCESS;
 }
 
@@ -0,0 +1,1587 @@
+/* Installer benchmark: times the archive and copy core of Installer.c on
+ * synthetic archives. Builds on Linux (or any POSIX system) with CMake, so
+ * every performance change can be measured against a baseline without a
+ * Windows machine or the server share.
+ *
+ * Usage: installer-bench [options] <work_dir>
+ *
+ * Options:
+ *     --scale N       Multiply file counts and sizes (default: 1)
+ *     --threads N     Extraction threads (default: one per processor)
+ *     --only P        Run one profile: tiny, huge, deep, random or bundle
+ *     --json          One JSON object per result instead of a table
+ *     --keep          Leave the generated archives in work_dir
+ *     --bundle F      Also run everything on the zip F, a real bundle
+ *     --codecs        Also compare zlib's deflate with libdeflate, zstd
+ *                     and xz (when built with them): size, and encode
+ *                     and decode MB/s
+ *
+ * Profiles (at scale 1):
+ *     tiny      20,000 small text files, 200 to a directory
+ *     huge      4 files of 64 MB, compressible
+ *     deep      50 chains of 32 nested directories, a file at each level
+ *     random    16 files of 8 MB of incompressible data, stored
+ *
+ * For each profile a zip is written, then:
+ *     copy      4 KB fread/fwrite loop (CopyFileBuffered) and 4 MB blocks
+ *               (the block size of CopyFileOverlapped)
+ *     copy offload  as CopyFileOffload: the kernel does the copy, by 
+ *               reflink (FICLONE) or copy_file_range, falling back to 
+ *               the 4 MB loop; the op is named after the path taken
+ *     mkdir     one CreateDirectories per entry, as extraction used to,
+ *               against each directory once, shallowest first
+ *               (CreateExtractDirs)
+ *     extract   as ExtractZip: largest entries first from a shared counter,
+ *               one libzip handle per thread, 4 KB reads
+ *     stored    entries packed with STORE, copied from their offset in
+ *               the zip as CopyStoredEntry does: a 4 KB read and write 
+ *               loop (what going through libzip amounts to) against 
+ *               copy_file_range, which reflinks on btrfs and XFS, with 
+ *               writes from a mapping of the zip where it can't be used
+ *     delete    the extracted tree, as DeleteDirectoryContents
+ *
+ *     codecs    every file compressed on its own, as a zip entry is, at
+ *               the level libzip uses (deflate 6, zstd 3, xz 6), then
+ *               decoded in one call and compared with the original
+ *
+ * Reported: wall time, MB/s, files/s and peak RSS during the operation.
+ * The page cache is left alone, so copies of small archives are warm.
+ *
+ * Without libzip the extraction is replaced by writing the same files
+ * straight from the generator.
+ */
+
+#define _GNU_SOURCE
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+#include <zlib.h>
+#ifdef __linux__
+#include <linux/fs.h>           // FICLONE
+#endif
+#ifdef HAVE_LIBZIP
+#include <zip.h>
+#endif
+#ifdef HAVE_LIBDEFLATE
+#include <libdeflate.h>
+#endif
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+#ifdef HAVE_LZMA
+#include <lzma.h>
+#endif
+
+#define MAXTHREADS 64
+#define MAXNAME 256                     // In the archive
+#define MAXPATH PATH_MAX                // On disk
+#define CHUNK (64 * 1024)
+#define COPYSMALL 4096                  // CopyFileBuffered
+#define COPYBLOCK (4 * 1024 * 1024)     // CopyFileOverlapped
+#define READBUFFER 4096                 // ExtractEntry
+
+#define ZIPSTORE 0
+#define ZIPDEFLATE 8
+
+#define DATATEXT 0
+#define DATARANDOM 1
+#define DATAZIP 2                       // An entry of a --bundle zip
+
+static int SCALE = 1;
+static int THREADS = 0;
+static int JSON = 0;
+static int KEEP = 0;
+static int CODECS = 0;
+static const char* ONLY = NULL;
+
+// A file in a synthetic archive. Its contents come from seed, so every
+// run (and every writer) produces the same bytes.
+typedef struct {
+    char name[MAXNAME];
+    uint64_t size;
+    int kind;
+    int method;
+    uint64_t seed;
+    uint64_t offset;            // DATAZIP: of the local header
+    uint64_t compSize;          // DATAZIP
+    uint32_t crc;               // DATAZIP
+} FILESPEC;
+
+typedef struct {
+    const char* name;
+    FILESPEC* files;
+    long count;
+    long capacity;
+    char** dirs;                // Every directory, with a trailing '/'
+    long dirCount;
+    long dirCapacity;
+    int fd;                     // The --bundle zip, or -1
+} PROFILE;
+
+// What one timed operation did
+typedef struct {
+    const char* profile;
+    const char* op;
+    long files;
+    uint64_t bytes;
+    double seconds;
+    long peakRssKb;
+    uint64_t packed;            // Codecs: compressed size
+} RESULT;
+
+//============================================================================
+// Timing and memory
+
+static double Now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Linux can reset the peak RSS of a process; elsewhere it is the peak so far
+static void ResetPeakRss(void) {
+    int fd = open("/proc/self/clear_refs", O_WRONLY);
+    if (fd >= 0) {
+        if (write(fd, "5", 1) != 1) {
+            // Not supported: the peak is since the start
+        }
+        close(fd);
+    }
+}
+
+static long PeakRssKb(void) {
+    char line[256];
+    long kb = -1;
+    FILE* f = fopen("/proc/self/status", "r");
+    if (f != NULL) {
+        while (fgets(line, sizeof(line), f) != NULL) {
+            if (strncmp(line, "VmHWM:", 6) == 0) {
+                kb = strtol(line + 6, NULL, 10);
+                break;
+            }
+        }
+        fclose(f);
+    }
+    if (kb < 0) {
+        struct rusage usage;
+        getrusage(RUSAGE_SELF, &usage);
+        kb = usage.ru_maxrss;
+    }
+    return kb;
+}
+
+static void Report(const RESULT* r) {
+    static int header = 0;
+    double mb = r->bytes / (1024.0 * 1024.0);
+    double mbps = r->seconds > 0 ? mb / r->seconds : 0.0;
+    double fps = r->seconds > 0 ? r->files / r->seconds : 0.0;
+    if (JSON) {
+        printf("{\"profile\":\"%s\",\"op\":\"%s\",\"files\":%ld,"
+            "\"bytes\":%llu,\"seconds\":%.4f,\"MBps\":%.1f,"
+            "\"filesPerSecond\":%.0f,\"peakRssKb\":%ld,"
+            "\"packedBytes\":%llu}\n", r->profile, r->op, r->files,
+            (unsigned long long)r->bytes, r->seconds, mbps, fps,
+            r->peakRssKb, (unsigned long long)r->packed);
+    } else {
+        if (!header) {
+            printf("%-8s %-18s %8s %10s %9s %9s %10s %10s %10s\n",
+                "profile", "operation", "files", "MB", "seconds", "MB/s",
+                "files/s", "peak RSS", "packed MB");
+            header = 1;
+        }
+        printf("%-8s %-18s %8ld %10.1f %9.3f %9.1f %10.0f %7ld MB",
+            r->profile, r->op, r->files, mb, r->seconds, mbps, fps,
+            r->peakRssKb / 1024);
+        if (r->packed > 0)
+            printf(" %10.1f", r->packed / (1024.0 * 1024.0));
+        printf("\n");
+    }
+    fflush(stdout);
+}
+
+//============================================================================
+// Synthetic data. xorshift64* for speed; text is words from a small list,
+// so it compresses about as well as source and config files do.
+
+static const char* WORDS[] = {
+    "install", "shortcut", "version", "config", "value", "return", "static",
+    "const", "while", "entry", "archive", "directory", "update", "server",
+    "local", "cache", "thread", "buffer", "message", "error", "the", "a",
+    "of", "to", "in", "is", "for", "on", "with", "and", "0x1f", "42"
+};
+#define WORDCOUNT (sizeof(WORDS) / sizeof(WORDS[0]))
+
+static uint64_t NextRandom(uint64_t* state) {
+    uint64_t x = *state;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    *state = x;
+    return x * 0x2545F4914F6CDD1DULL;
+}
+
+static void FillData(uint64_t* state, int kind, unsigned char* buf,
+        size_t len) {
+    size_t i = 0;
+    if (kind == DATARANDOM) {
+        for (; i + 8 <= len; i += 8) {
+            uint64_t r = NextRandom(state);
+            memcpy(buf + i, &r, 8);
+        }
+        for (; i < len; i++)
+            buf[i] = (unsigned char)NextRandom(state);
+        return;
+    }
+    while (i < len) {
+        uint64_t r = NextRandom(state);
+        const char* word = WORDS[r % WORDCOUNT];
+        size_t n = strlen(word);
+        for (size_t j = 0; j < n && i < len; j++)
+            buf[i++] = (unsigned char)word[j];
+        if (i < len)
+            buf[i++] = ((r >> 32) % 12 == 0) ? '\n' : ' ';
+    }
+}
+
+//============================================================================
+// Profiles
+
+static void AddDir(PROFILE* p, const char* dir) {
+    if (p->dirCount == p->dirCapacity) {
+        p->dirCapacity = p->dirCapacity ? p->dirCapacity * 2 : 256;
+        p->dirs = realloc(p->dirs, p->dirCapacity * sizeof(char*));
+    }
+    p->dirs[p->dirCount++] = strdup(dir);
+}
+
+static void AddFile(PROFILE* p, const char* name, uint64_t size, int kind,
+        int method) {
+    if (p->count == p->capacity) {
+        p->capacity = p->capacity ? p->capacity * 2 : 1024;
+        p->files = realloc(p->files, p->capacity * sizeof(FILESPEC));
+    }
+    FILESPEC* f = &p->files[p->count];
+    snprintf(f->name, MAXNAME, "%s", name);
+    f->size = size;
+    f->kind = kind;
+    f->method = method;
+    f->seed = 0x9E3779B97F4A7C15ULL * (uint64_t)(p->count + 1);
+    p->count++;
+}
+
+static void BuildProfile(PROFILE* p, const char* name) {
+    char path[MAXNAME];
+    uint64_t state = 88172645463325252ULL;
+    memset(p, 0, sizeof(PROFILE));
+    p->name = name;
+    p->fd = -1;
+
+    if (strcmp(name, "tiny") == 0) {
+        long files = 20000L * SCALE;
+        AddDir(p, "tiny/");
+        for (long i = 0; i < files; i++) {
+            if (i % 200 == 0) {
+                snprintf(path, MAXNAME, "tiny/d%04ld/", i / 200);
+                AddDir(p, path);
+            }
+            snprintf(path, MAXNAME, "tiny/d%04ld/f%06ld.txt", i / 200, i);
+            AddFile(p, path, 64 + NextRandom(&state) % 4032, DATATEXT,
+                ZIPDEFLATE);
+        }
+    } else if (strcmp(name, "huge") == 0) {
+        AddDir(p, "huge/");
+        for (int i = 0; i < 4; i++) {
+            snprintf(path, MAXNAME, "huge/blob%d.bin", i);
+            AddFile(p, path, 64ULL * 1024 * 1024 * SCALE, DATATEXT,
+                ZIPDEFLATE);
+        }
+    } else if (strcmp(name, "deep") == 0) {
+        AddDir(p, "deep/");
+        for (int c = 0; c < 50 * SCALE; c++) {
+            int len = snprintf(path, MAXNAME, "deep/c%03d/", c);
+            AddDir(p, path);
+            for (int level = 1; level <= 32; level++) {
+                char file[MAXNAME];
+                if (snprintf(file, MAXNAME, "%sfile%02d.txt", path, level) 
+                        >= MAXNAME)
+                    break;
+                AddFile(p, file, 64 + NextRandom(&state) % 8192, DATATEXT,
+                    ZIPDEFLATE);
+                if (level < 32) {
+                    len += snprintf(path + len, MAXNAME - len, "l%02d/",
+                        level);
+                    AddDir(p, path);
+                }
+            }
+        }
+    } else if (strcmp(name, "random") == 0) {
+        AddDir(p, "random/");
+        for (int i = 0; i < 16 * SCALE; i++) {
+            snprintf(path, MAXNAME, "random/media%03d.bin", i);
+            AddFile(p, path, 8ULL * 1024 * 1024, DATARANDOM, ZIPSTORE);
+        }
+    }
+}
+
+static void FreeProfile(PROFILE* p) {
+    for (long i = 0; i < p->dirCount; i++)
+        free(p->dirs[i]);
+    free(p->dirs);
+    free(p->files);
+    if (p->fd >= 0)
+        close(p->fd);
+}
+
+static uint64_t ProfileBytes(const PROFILE* p) {
+    uint64_t total = 0;
+    for (long i = 0; i < p->count; i++)
+        total += p->files[i].size;
+    return total;
+}
+
+//============================================================================
+// Zip writer: local headers are written with zero CRC and sizes, then
+// patched once the data is out. ZIP64 end records are added past 65,535
+// entries; offsets must stay under 4 GB.
+
+typedef struct {
+    uint32_t crc;
+    uint32_t compressedSize;
+    uint32_t size;
+    uint32_t offset;
+    uint16_t method;
+    int isDir;
+    const char* name;
+} ZIPRECORD;
+
+static void Put16(unsigned char* p, uint16_t v) {
+    p[0] = (unsigned char)v;
+    p[1] = (unsigned char)(v >> 8);
+}
+
+static void Put32(unsigned char* p, uint32_t v) {
+    Put16(p, (uint16_t)v);
+    Put16(p + 2, (uint16_t)(v >> 16));
+}
+
+static void Put64(unsigned char* p, uint64_t v) {
+    Put32(p, (uint32_t)v);
+    Put32(p + 4, (uint32_t)(v >> 32));
+}
+
+#define DOSTIME 0x6000      // 12:00:00
+#define DOSDATE 0x5921      // 2024-09-01
+
+static int WriteLocalHeader(FILE* f, const ZIPRECORD* r) {
+    unsigned char h[30] = { 0 };
+    uint16_t nameLen = (uint16_t)strlen(r->name);
+    Put32(h, 0x04034b50);
+    Put16(h + 4, 20);
+    Put16(h + 8, r->method);
+    Put16(h + 10, DOSTIME);
+    Put16(h + 12, DOSDATE);
+    Put32(h + 14, r->crc);
+    Put32(h + 18, r->compressedSize);
+    Put32(h + 22, r->size);
+    Put16(h + 26, nameLen);
+    return fwrite(h, 1, 30, f) == 30 &&
+        fwrite(r->name, 1, nameLen, f) == nameLen;
+}
+
+// Data of one file, stored or deflated, streamed from the generator
+static int WriteEntryData(FILE* f, const FILESPEC* spec, ZIPRECORD* r,
+        unsigned char* in, unsigned char* out) {
+    uint64_t state = spec->seed;
+    uint64_t left = spec->size;
+    uint64_t written = 0;
+    uLong crc = crc32(0L, Z_NULL, 0);
+    z_stream zs;
+    memset(&zs, 0, sizeof(zs));
+    if (r->method == ZIPDEFLATE &&
+            deflateInit2(&zs, 6, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) !=
+            Z_OK)
+        return 0;
+
+    do {
+        size_t len = left < CHUNK ? (size_t)left : CHUNK;
+        FillData(&state, spec->kind, in, len);
+        crc = crc32(crc, in, (uInt)len);
+        left -= len;
+        if (r->method == ZIPSTORE) {
+            if (fwrite(in, 1, len, f) != len)
+                return 0;
+            written += len;
+            continue;
+        }
+        zs.next_in = in;
+        zs.avail_in = (uInt)len;
+        int flush = left == 0 ? Z_FINISH : Z_NO_FLUSH;
+        int status;
+        do {
+            zs.next_out = out;
+            zs.avail_out = CHUNK;
+            status = deflate(&zs, flush);
+            size_t have = CHUNK - zs.avail_out;
+            if (fwrite(out, 1, have, f) != have) {
+                deflateEnd(&zs);
+                return 0;
+            }
+            written += have;
+        } while (zs.avail_out == 0 || (flush == Z_FINISH &&
+            status != Z_STREAM_END));
+    } while (left > 0);
+    if (r->method == ZIPDEFLATE)
+        deflateEnd(&zs);
+
+    r->crc = (uint32_t)crc;
+    r->compressedSize = (uint32_t)written;
+    r->size = (uint32_t)spec->size;
+    return 1;
+}
+
+static int WriteCentralDirectory(FILE* f, ZIPRECORD* records, long count) {
+    unsigned char h[56];
+    uint64_t start = (uint64_t)ftello(f);
+    for (long i = 0; i < count; i++) {
+        const ZIPRECORD* r = &records[i];
+        uint16_t nameLen = (uint16_t)strlen(r->name);
+        memset(h, 0, 46);
+        Put32(h, 0x02014b50);
+        Put16(h + 4, 0x0314);           // Unix, 2.0
+        Put16(h + 6, 20);
+        Put16(h + 10, r->method);
+        Put16(h + 12, DOSTIME);
+        Put16(h + 14, DOSDATE);
+        Put32(h + 16, r->crc);
+        Put32(h + 20, r->compressedSize);
+        Put32(h + 24, r->size);
+        Put16(h + 28, nameLen);
+        Put32(h + 38, r->isDir ? (040755u << 16) | 0x10 : 0100644u << 16);
+        Put32(h + 42, r->offset);
+        if (fwrite(h, 1, 46, f) != 46 ||
+                fwrite(r->name, 1, nameLen, f) != nameLen)
+            return 0;
+    }
+    uint64_t end = (uint64_t)ftello(f);
+    uint64_t size = end - start;
+
+    if (count > 0xFFFF) {
+        // ZIP64 end of central directory record and locator
+        memset(h, 0, 56);
+        Put32(h, 0x06064b50);
+        Put64(h + 4, 44);
+        Put16(h + 12, 45);
+        Put16(h + 14, 45);
+        Put64(h + 24, (uint64_t)count);
+        Put64(h + 32, (uint64_t)count);
+        Put64(h + 40, size);
+        Put64(h + 48, start);
+        if (fwrite(h, 1, 56, f) != 56)
+            return 0;
+        memset(h, 0, 20);
+        Put32(h, 0x07064b50);
+        Put64(h + 8, end);
+        Put32(h + 16, 1);
+        if (fwrite(h, 1, 20, f) != 20)
+            return 0;
+    }
+    memset(h, 0, 22);
+    Put32(h, 0x06054b50);
+    Put16(h + 8, count > 0xFFFF ? 0xFFFF : (uint16_t)count);
+    Put16(h + 10, count > 0xFFFF ? 0xFFFF : (uint16_t)count);
+    Put32(h + 12, (uint32_t)size);
+    Put32(h + 16, (uint32_t)start);
+    return fwrite(h, 1, 22, f) == 22;
+}
+
+static int WriteZip(const PROFILE* p, const char* path, uint64_t* zipSize) {
+    long total = p->dirCount + p->count;
+    ZIPRECORD* records = calloc(total, sizeof(ZIPRECORD));
+    unsigned char* in = malloc(CHUNK);
+    unsigned char* out = malloc(CHUNK);
+    FILE* f = fopen(path, "wb");
+    int ok = records != NULL && in != NULL && out != NULL && f != NULL;
+    long n = 0;
+
+    // Directories first, as most zip tools write them
+    for (long i = 0; ok && i < p->dirCount; i++, n++) {
+        records[n].name = p->dirs[i];
+        records[n].isDir = 1;
+        records[n].offset = (uint32_t)ftello(f);
+        ok = WriteLocalHeader(f, &records[n]);
+    }
+    for (long i = 0; ok && i < p->count; i++, n++) {
+        ZIPRECORD* r = &records[n];
+        off_t offset = ftello(f);
+        if ((uint64_t)offset > 0xFFFFFFFFULL) {
+            fprintf(stderr, "Archive over 4 GB: use a smaller --scale\n");
+            ok = 0;
+            break;
+        }
+        r->name = p->files[i].name;
+        r->method = (uint16_t)p->files[i].method;
+        r->offset = (uint32_t)offset;
+        ok = WriteLocalHeader(f, r) && WriteEntryData(f, &p->files[i], r,
+            in, out);
+        // Patch CRC and sizes into the local header
+        if (ok) {
+            unsigned char h[12];
+            off_t end = ftello(f);
+            Put32(h, r->crc);
+            Put32(h + 4, r->compressedSize);
+            Put32(h + 8, r->size);
+            ok = fseeko(f, offset + 14, SEEK_SET) == 0 &&
+                fwrite(h, 1, 12, f) == 12 && fseeko(f, end, SEEK_SET) == 0;
+        }
+    }
+    if (ok)
+        ok = WriteCentralDirectory(f, records, n);
+    if (ok)
+        *zipSize = (uint64_t)ftello(f);
+    if (f != NULL && fclose(f) != 0)
+        ok = 0;
+    free(records);
+    free(in);
+    free(out);
+    return ok;
+}
+
+//============================================================================
+// Bundle reader: the central directory of a real zip, ZIP64 included, as
+// a profile. Its files are read back by LoadData.
+
+static uint16_t Get16(const unsigned char* p) {
+    return (uint16_t)(p[0] | (p[1] << 8));
+}
+
+static uint32_t Get32(const unsigned char* p) {
+    return Get16(p) | ((uint32_t)Get16(p + 2) << 16);
+}
+
+static uint64_t Get64(const unsigned char* p) {
+    return Get32(p) | ((uint64_t)Get32(p + 4) << 32);
+}
+
+static int CompareString(const void* a, const void* b) {
+    return strcmp(*(char* const*)a, *(char* const*)b);
+}
+
+// Every directory a file is in, once each
+static void AddParentDirs(PROFILE* p) {
+    char dir[MAXNAME];
+    for (long i = 0; i < p->count; i++) {
+        snprintf(dir, MAXNAME, "%s", p->files[i].name);
+        for (char* c = dir; *c; c++) {
+            if (*c == '/') {
+                char next = c[1];
+                c[1] = '\0';
+                AddDir(p, dir);
+                c[1] = next;
+            }
+        }
+    }
+    qsort(p->dirs, p->dirCount, sizeof(char*), CompareString);
+    long unique = 0;
+    for (long i = 0; i < p->dirCount; i++) {
+        if (unique > 0 && strcmp(p->dirs[unique - 1], p->dirs[i]) == 0)
+            free(p->dirs[i]);
+        else
+            p->dirs[unique++] = p->dirs[i];
+    }
+    p->dirCount = unique;
+}
+
+static int BuildBundle(PROFILE* p, const char* path) {
+    unsigned char tail[65536 + 22];
+    unsigned char h[56];
+    struct stat st;
+    memset(p, 0, sizeof(PROFILE));
+    p->name = "bundle";
+    p->fd = open(path, O_RDONLY);
+    if (p->fd < 0 || fstat(p->fd, &st) != 0 || st.st_size < 22)
+        return 0;
+
+    // End of central directory: the last signature in the last 64 KB
+    size_t tailLen = st.st_size < (off_t)sizeof(tail) ? 
+        (size_t)st.st_size : sizeof(tail);
+    off_t tailStart = st.st_size - (off_t)tailLen;
+    if (pread(p->fd, tail, tailLen, tailStart) != (ssize_t)tailLen)
+        return 0;
+    long eocd = -1;
+    for (long i = (long)tailLen - 22; i >= 0 && eocd < 0; i--) {
+        if (Get32(tail + i) == 0x06054b50)
+            eocd = i;
+    }
+    if (eocd < 0)
+        return 0;
+    uint64_t entries = Get16(tail + eocd + 10);
+    uint64_t cdSize = Get32(tail + eocd + 12);
+    uint64_t cdStart = Get32(tail + eocd + 16);
+    if (eocd >= 20 && Get32(tail + eocd - 20) == 0x07064b50) {
+        // ZIP64: the real numbers are in the record the locator points at
+        uint64_t record = Get64(tail + eocd - 20 + 8);
+        if (pread(p->fd, h, 56, (off_t)record) != 56 || 
+                Get32(h) != 0x06064b50)
+            return 0;
+        entries = Get64(h + 32);
+        cdSize = Get64(h + 40);
+        cdStart = Get64(h + 48);
+    }
+
+    unsigned char* cd = malloc(cdSize);
+    if (cd == NULL || pread(p->fd, cd, cdSize, (off_t)cdStart) != 
+            (ssize_t)cdSize) {
+        free(cd);
+        return 0;
+    }
+    size_t pos = 0;
+    for (uint64_t n = 0; n < entries && pos + 46 <= cdSize; n++) {
+        const unsigned char* e = cd + pos;
+        if (Get32(e) != 0x02014b50)
+            break;
+        uint16_t nameLen = Get16(e + 28);
+        uint16_t extraLen = Get16(e + 30);
+        uint16_t commentLen = Get16(e + 32);
+        uint64_t compSize = Get32(e + 20);
+        uint64_t size = Get32(e + 24);
+        uint64_t offset = Get32(e + 42);
+        // ZIP64 extra field: whichever of the three overflowed, in order
+        const unsigned char* x = e + 46 + nameLen;
+        const unsigned char* xEnd = x + extraLen;
+        while (x + 4 <= xEnd) {
+            uint16_t id = Get16(x), len = Get16(x + 2);
+            const unsigned char* v = x + 4;
+            if (id == 0x0001) {
+                if (size == 0xFFFFFFFF && v + 8 <= x + 4 + len) {
+                    size = Get64(v);
+                    v += 8;
+                }
+                if (compSize == 0xFFFFFFFF && v + 8 <= x + 4 + len) {
+                    compSize = Get64(v);
+                    v += 8;
+                }
+                if (offset == 0xFFFFFFFF && v + 8 <= x + 4 + len)
+                    offset = Get64(v);
+            }
+            x += 4 + len;
+        }
+        char name[MAXNAME];
+        if (nameLen >= MAXNAME) {
+            // Cut short, it would name some other file
+            fprintf(stderr, "Entry name too long: %.*s\n", (int)nameLen, 
+                e + 46);
+            free(cd);
+            return 0;
+        }
+        snprintf(name, MAXNAME, "%.*s", (int)nameLen, e + 46);
+        if (nameLen > 0 && name[strlen(name) - 1] != '/') {
+            AddFile(p, name, size, DATAZIP, Get16(e + 10));
+            p->files[p->count - 1].offset = offset;
+            p->files[p->count - 1].compSize = compSize;
+            p->files[p->count - 1].crc = Get32(e + 16);
+        }
+        pos += 46 + nameLen + extraLen + commentLen;
+    }
+    free(cd);
+    AddParentDirs(p);
+    return p->count > 0;
+}
+
+// The whole of a file into out, which holds spec->size bytes. Bundle 
+// entries are inflated from the zip; only store and deflate are read.
+static int LoadData(const PROFILE* p, const FILESPEC* spec, 
+        unsigned char* out) {
+    unsigned char h[30];
+    if (spec->kind != DATAZIP) {
+        uint64_t state = spec->seed;
+        FillData(&state, spec->kind, out, spec->size);
+        return 1;
+    }
+    if (pread(p->fd, h, 30, (off_t)spec->offset) != 30 || 
+            Get32(h) != 0x04034b50)
+        return 0;
+    off_t data = (off_t)spec->offset + 30 + Get16(h + 26) + Get16(h + 28);
+    if (spec->method == ZIPSTORE) {
+        return spec->compSize == spec->size && pread(p->fd, out, 
+            spec->size, data) == (ssize_t)spec->size;
+    }
+    if (spec->method != ZIPDEFLATE)
+        return 0;
+    unsigned char* in = malloc(spec->compSize + 1);
+    int ok = in != NULL && pread(p->fd, in, spec->compSize, data) == 
+        (ssize_t)spec->compSize;
+    z_stream zs;
+    memset(&zs, 0, sizeof(zs));
+    if (ok && inflateInit2(&zs, -15) == Z_OK) {
+        zs.next_in = in;
+        zs.avail_in = (uInt)spec->compSize;
+        zs.next_out = out;
+        zs.avail_out = (uInt)spec->size;
+        ok = inflate(&zs, Z_FINISH) == Z_STREAM_END && 
+            zs.total_out == spec->size;
+        inflateEnd(&zs);
+    } else {
+        ok = 0;
+    }
+    free(in);
+    return ok;
+}
+
+//============================================================================
+// Copy engines
+
+static int CopyLoop(const char* src, const char* dst, size_t block,
+        uint64_t* copied) {
+    unsigned char* buffer = malloc(block);
+    int in = open(src, O_RDONLY);
+    int out = open(dst, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    int ok = buffer != NULL && in >= 0 && out >= 0;
+    ssize_t n = 0;
+    *copied = 0;
+    while (ok && (n = read(in, buffer, block)) > 0) {
+        if (write(out, buffer, (size_t)n) != n)
+            ok = 0;
+        *copied += (uint64_t)n;
+    }
+    if (n < 0)
+        ok = 0;
+    if (in >= 0)
+        close(in);
+    if (out >= 0 && close(out) != 0)
+        ok = 0;
+    free(buffer);
+    return ok;
+}
+
+// The kernel's copy, in place of CopyFileEx. A reflink shares the blocks
+// (btrfs, XFS); copy_file_range copies inside the kernel, or on the 
+// server for NFS and SMB. Sets how to the path that did the copy.
+static int CopyOffload(const char* src, const char* dst, uint64_t* copied,
+        const char** how) {
+    struct stat st;
+    int in = open(src, O_RDONLY);
+    int out = open(dst, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    int ok = in >= 0 && out >= 0 && fstat(in, &st) == 0;
+    *copied = 0;
+    *how = "copy reflink";
+#ifdef FICLONE
+    if (ok && ioctl(out, FICLONE, in) == 0)
+        *copied = (uint64_t)st.st_size;
+#endif
+    if (ok && *copied < (uint64_t)st.st_size) {
+        *how = "copy_file_range";
+        ssize_t n;
+        while (*copied < (uint64_t)st.st_size && (n = copy_file_range(in, 
+                NULL, out, NULL, (size_t)(st.st_size - *copied), 0)) > 0)
+            *copied += (uint64_t)n;
+    }
+    if (in >= 0)
+        close(in);
+    if (out >= 0 && close(out) != 0)
+        ok = 0;
+    if (ok && *copied < (uint64_t)st.st_size) {
+        *how = "copy 4 MB fallback";
+        return CopyLoop(src, dst, COPYBLOCK, copied);
+    }
+    return ok;
+}
+
+// The 4 KB loop of CopyFileBuffered goes through stdio, as it does there
+static int CopyStdio(const char* src, const char* dst, uint64_t* copied) {
+    char buffer[COPYSMALL];
+    size_t n;
+    FILE* in = fopen(src, "rb");
+    FILE* out = fopen(dst, "wb");
+    int ok = in != NULL && out != NULL;
+    *copied = 0;
+    while (ok && (n = fread(buffer, 1, sizeof(buffer), in)) > 0) {
+        if (fwrite(buffer, 1, n, out) != n)
+            ok = 0;
+        *copied += n;
+    }
+    if (in != NULL)
+        fclose(in);
+    if (out != NULL && fclose(out) != 0)
+        ok = 0;
+    return ok;
+}
+
+//============================================================================
+// Directories
+
+// dir/name into out. A path cut short would create or delete some other 
+// file, so that is reported and 0 returned instead.
+static int JoinPath(char* out, size_t size, const char* dir, 
+        const char* name) {
+    int len = snprintf(out, size, "%s/%s", dir, name);
+    if (len >= 0 && (size_t)len < size)
+        return 1;
+    fprintf(stderr, "Path too long: %s/%s\n", dir, name);
+    return 0;
+}
+
+// Every missing component of path's directory, as CreateDirectories does
+static long CreateDirectories(const char* path) {
+    char temp[MAXPATH];
+    long calls = 0;
+    struct stat st;
+    if (strlen(path) >= sizeof(temp))
+        return 0;
+    strcpy(temp, path);
+    char* last = strrchr(temp, '/');
+    if (last == NULL)
+        return 0;
+    *last = '\0';
+    for (char* p = temp + 1; ; p++) {
+        if (*p == '/' || *p == '\0') {
+            char c = *p;
+            *p = '\0';
+            calls++;
+            if (stat(temp, &st) != 0) {
+                calls++;
+                mkdir(temp, 0755);
+            }
+            *p = c;
+            if (c == '\0')
+                break;
+        }
+    }
+    return calls;
+}
+
+static int CompareDepth(const void* a, const void* b) {
+    const char* da = *(const char* const*)a;
+    const char* db = *(const char* const*)b;
+    int depthA = 0, depthB = 0;
+    for (; *da; da++)
+        depthA += *da == '/';
+    for (; *db; db++)
+        depthB += *db == '/';
+    return depthA - depthB;
+}
+
+// Each directory once, shallowest first, as CreateExtractDirs does
+static long CreateDirsOnce(const PROFILE* p, const char* outdir) {
+    char path[MAXPATH];
+    char** dirs = malloc(p->dirCount * sizeof(char*));
+    long calls = 0;
+    memcpy(dirs, p->dirs, p->dirCount * sizeof(char*));
+    qsort(dirs, p->dirCount, sizeof(char*), CompareDepth);
+    for (long i = 0; i < p->dirCount; i++) {
+        if (!JoinPath(path, sizeof(path), outdir, dirs[i]))
+            continue;
+        calls++;
+        if (mkdir(path, 0755) != 0 && errno != EEXIST)
+            calls += CreateDirectories(path);
+    }
+    free(dirs);
+    return calls;
+}
+
+static long CreateDirsPerEntry(const PROFILE* p, const char* outdir) {
+    char path[MAXPATH];
+    long calls = 0;
+    for (long i = 0; i < p->count; i++) {
+        if (JoinPath(path, sizeof(path), outdir, p->files[i].name))
+            calls += CreateDirectories(path);
+    }
+    return calls;
+}
+
+// As DeleteDirectoryContents, then the directory itself
+static long DeleteTree(const char* path) {
+    char child[MAXPATH];
+    long deleted = 0;
+    DIR* dir = opendir(path);
+    struct dirent* e;
+    if (dir == NULL)
+        return 0;
+    while ((e = readdir(dir)) != NULL) {
+        if (strcmp(e->d_name, ".") == 0 || strcmp(e->d_name, "..") == 0)
+            continue;
+        if (!JoinPath(child, sizeof(child), path, e->d_name))
+            continue;
+        struct stat st;
+        if (lstat(child, &st) == 0 && S_ISDIR(st.st_mode)) {
+            deleted += DeleteTree(child);
+        } else if (unlink(child) == 0) {
+            deleted++;
+        }
+    }
+    closedir(dir);
+    rmdir(path);
+    return deleted;
+}
+
+//============================================================================
+// Extraction
+
+#ifdef HAVE_LIBZIP
+
+typedef struct {
+    zip_uint64_t index;
+    zip_uint64_t size;
+    const char* name;
+} EXTRACTENTRY;
+
+typedef struct {
+    const char* zipfile;
+    const char* outdir;
+    EXTRACTENTRY* entries;
+    long count;
+    atomic_long next;
+    atomic_long errors;
+    atomic_long files;
+} EXTRACTJOB;
+
+static int ExtractEntry(EXTRACTJOB* job, zip_t* z, const EXTRACTENTRY* e) {
+    char path[MAXPATH];
+    char buffer[READBUFFER];
+    zip_int64_t n;
+    size_t len = strlen(e->name);
+    if (len > 0 && e->name[len - 1] == '/')
+        return 0;               // Made by CreateDirsOnce
+    if (!JoinPath(path, sizeof(path), job->outdir, e->name))
+        return -1;
+    zip_file_t* zf = zip_fopen_index(z, e->index, 0);
+    if (zf == NULL)
+        return -1;
+    FILE* out = fopen(path, "wb");
+    if (out == NULL) {
+        zip_fclose(zf);
+        return -1;
+    }
+    while ((n = zip_fread(zf, buffer, sizeof(buffer))) > 0)
+        fwrite(buffer, 1, (size_t)n, out);
+    fclose(out);
+    zip_fclose(zf);
+    atomic_fetch_add(&job->files, 1);
+    return n < 0 ? -1 : 0;
+}
+
+static void* ExtractWorker(void* param) {
+    EXTRACTJOB* job = param;
+    int err = 0;
+    long i;
+    // libzip handles can't be shared between threads
+    zip_t* z = zip_open(job->zipfile, ZIP_RDONLY, &err);
+    if (z == NULL) {
+        atomic_fetch_add(&job->errors, 1);
+        return NULL;
+    }
+    while ((i = atomic_fetch_add(&job->next, 1)) < job->count) {
+        if (ExtractEntry(job, z, &job->entries[i]) != 0)
+            atomic_fetch_add(&job->errors, 1);
+    }
+    zip_discard(z);
+    return NULL;
+}
+
+static int CompareEntrySize(const void* a, const void* b) {
+    const EXTRACTENTRY* ea = a;
+    const EXTRACTENTRY* eb = b;
+    return (ea->size < eb->size) - (ea->size > eb->size);
+}
+
+static int ExtractZip(const char* zipfile, const PROFILE* p,
+        const char* outdir, long* files) {
+    EXTRACTJOB job;
+    pthread_t threads[MAXTHREADS];
+    int err = 0, started = 0;
+    zip_t* z = zip_open(zipfile, ZIP_RDONLY, &err);
+    if (z == NULL)
+        return 0;
+
+    memset(&job, 0, sizeof(job));
+    job.zipfile = zipfile;
+    job.outdir = outdir;
+    job.count = (long)zip_get_num_entries(z, 0);
+    job.entries = calloc(job.count, sizeof(EXTRACTENTRY));
+    for (long i = 0; i < job.count; i++) {
+        zip_stat_t st;
+        zip_stat_index(z, (zip_uint64_t)i, 0, &st);
+        job.entries[i].index = (zip_uint64_t)i;
+        job.entries[i].size = st.size;
+        job.entries[i].name = st.name;
+    }
+    qsort(job.entries, job.count, sizeof(EXTRACTENTRY), CompareEntrySize);
+    CreateDirsOnce(p, outdir);
+
+    int workers = THREADS > job.count ? (int)job.count : THREADS;
+    for (int t = 1; t < workers; t++) {
+        if (pthread_create(&threads[started], NULL, ExtractWorker, &job) == 0)
+            started++;
+    }
+    // This thread works the queue too, with the handle it already has
+    long i;
+    while ((i = atomic_fetch_add(&job.next, 1)) < job.count) {
+        if (ExtractEntry(&job, z, &job.entries[i]) != 0)
+            atomic_fetch_add(&job.errors, 1);
+    }
+    for (int t = 0; t < started; t++)
+        pthread_join(threads[t], NULL);
+    zip_discard(z);
+    free(job.entries);
+    *files = atomic_load(&job.files);
+    return atomic_load(&job.errors) == 0;
+}
+
+#endif
+
+//============================================================================
+// Stored entries. One thread, as this compares how the bytes move rather
+// than how the work is shared; the data is CRC checked either way.
+
+// Where a stored entry's data starts, from its local header
+static int StoredDataOffset(const PROFILE* p, const FILESPEC* spec, 
+        off_t* data) {
+    unsigned char h[30];
+    if (spec->kind != DATAZIP || spec->method != ZIPSTORE || 
+            spec->compSize != spec->size || 
+            pread(p->fd, h, 30, (off_t)spec->offset) != 30 || 
+            Get32(h) != 0x04034b50)
+        return 0;
+    *data = (off_t)spec->offset + 30 + Get16(h + 26) + Get16(h + 28);
+    return 1;
+}
+
+static int CopyStoredLoop(const PROFILE* p, const FILESPEC* spec, 
+        off_t data, int out) {
+    unsigned char buffer[READBUFFER];
+    uLong crc = crc32(0, Z_NULL, 0);
+    uint64_t done = 0;
+    while (done < spec->size) {
+        size_t len = spec->size - done < sizeof(buffer) ? 
+            (size_t)(spec->size - done) : sizeof(buffer);
+        if (pread(p->fd, buffer, len, data + (off_t)done) != (ssize_t)len ||
+                write(out, buffer, len) != (ssize_t)len)
+            return 0;
+        crc = crc32(crc, buffer, (uInt)len);
+        done += len;
+    }
+    return crc == spec->crc;
+}
+
+// The kernel moves the data; where it can't (another filesystem, an old 
+// kernel), it is written from the mapping, which the CRC reads anyway
+static int CopyStoredOffload(const PROFILE* p, const FILESPEC* spec, 
+        off_t data, int out, const unsigned char* map, long* offloaded) {
+    uint64_t done = 0;
+    off_t in = data;
+    while (done < spec->size) {
+        ssize_t n = copy_file_range(p->fd, &in, out, NULL, 
+            (size_t)(spec->size - done), 0);
+        if (n <= 0)
+            break;
+        done += (uint64_t)n;
+    }
+    if (done == spec->size) {
+        (*offloaded)++;
+    } else if (lseek(out, (off_t)done, SEEK_SET) < 0 || 
+            write(out, map + data + done, spec->size - done) != 
+            (ssize_t)(spec->size - done)) {
+        return 0;
+    }
+    uLong crc = crc32(0, Z_NULL, 0);
+    for (uint64_t at = 0; at < spec->size; at += 1u << 30) {
+        uint64_t len = spec->size - at < (1u << 30) ? spec->size - at : 
+            (1u << 30);
+        crc = crc32(crc, map + data + at, (uInt)len);
+    }
+    return crc == spec->crc;
+}
+
+// Every stored entry of the zip p was read from, by loop or offload
+static int CopyStoredEntries(const PROFILE* p, const char* outdir, 
+        int offload, long* files, uint64_t* bytes) {
+    char path[MAXPATH];
+    struct stat st;
+    unsigned char* map = NULL;
+    long offloaded = 0;
+    int ok = fstat(p->fd, &st) == 0;
+    if (ok && offload) {
+        map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, p->fd, 
+            0);
+        ok = map != MAP_FAILED;
+    }
+    CreateDirsOnce(p, outdir);
+    *files = 0;
+    *bytes = 0;
+    for (long i = 0; ok && i < p->count; i++) {
+        const FILESPEC* spec = &p->files[i];
+        off_t data;
+        if (!StoredDataOffset(p, spec, &data))
+            continue;
+        if ((uint64_t)data + spec->size > (uint64_t)st.st_size) {
+            ok = 0;
+            break;
+        }
+        if (!JoinPath(path, sizeof(path), outdir, spec->name)) {
+            ok = 0;
+            break;
+        }
+        int out = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (out < 0) {
+            ok = 0;
+            break;
+        }
+        ok = offload ? CopyStoredOffload(p, spec, data, out, map, 
+            &offloaded) : CopyStoredLoop(p, spec, data, out);
+        if (close(out) != 0)
+            ok = 0;
+        (*files)++;
+        *bytes += spec->size;
+    }
+    if (offload && offloaded < *files)
+        fprintf(stderr, "%s: %ld of %ld stored entries written from the "
+            "mapping, not offloaded\n", p->name, *files - offloaded, *files);
+    if (map != NULL && map != MAP_FAILED)
+        munmap(map, (size_t)st.st_size);
+    return ok;
+}
+
+// Without libzip: the same files, straight from the generator (or, for a 
+// bundle, the zip)
+static int WriteFiles(const PROFILE* p, const char* outdir, long* files) {
+    char path[MAXPATH];
+    unsigned char* buffer = malloc(CHUNK);
+    int ok = buffer != NULL;
+    CreateDirsOnce(p, outdir);
+    *files = 0;
+    for (long i = 0; ok && i < p->count; i++) {
+        const FILESPEC* spec = &p->files[i];
+        uint64_t state = spec->seed;
+        uint64_t left = spec->size;
+        if (!JoinPath(path, sizeof(path), outdir, spec->name)) {
+            ok = 0;
+            break;
+        }
+        FILE* out = fopen(path, "wb");
+        if (out == NULL) {
+            ok = 0;
+            break;
+        }
+        if (spec->kind == DATAZIP) {
+            // Bundle entries are loaded whole
+            unsigned char* data = malloc(spec->size + 1);
+            ok = data != NULL && LoadData(p, spec, data) && 
+                fwrite(data, 1, spec->size, out) == spec->size;
+            free(data);
+            left = 0;
+        }
+        while (left > 0) {
+            size_t len = left < CHUNK ? (size_t)left : CHUNK;
+            FillData(&state, spec->kind, buffer, len);
+            fwrite(buffer, 1, len, out);
+            left -= len;
+        }
+        fclose(out);
+        (*files)++;
+    }
+    free(buffer);
+    return ok;
+}
+
+//============================================================================
+// Codecs. Each file is compressed on its own, as a zip entry is, then 
+// decoded in one call. libzip streams instead, so these decode rates are
+// what the codec can do rather than what ExtractZip gets today.
+
+typedef struct {
+    const char* name;
+    size_t (*bound)(size_t len);
+    // Return the compressed size, or 0 on failure
+    size_t (*encode)(const unsigned char* in, size_t len, unsigned char* out,
+        size_t cap);
+    int (*decode)(const unsigned char* in, size_t len, unsigned char* out,
+        size_t size);
+} CODEC;
+
+static size_t DeflateBound(size_t len) {
+    return len + len / 1000 + 64;   // Above zlib's deflateBound
+}
+
+static size_t DeflateEncode(const unsigned char* in, size_t len, 
+        unsigned char* out, size_t cap) {
+    z_stream zs;
+    size_t packed = 0;
+    memset(&zs, 0, sizeof(zs));
+    if (deflateInit2(&zs, 6, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+        return 0;
+    zs.next_in = (unsigned char*)in;
+    zs.avail_in = (uInt)len;
+    zs.next_out = out;
+    zs.avail_out = (uInt)cap;
+    if (deflate(&zs, Z_FINISH) == Z_STREAM_END)
+        packed = zs.total_out;
+    deflateEnd(&zs);
+    return packed;
+}
+
+static int DeflateDecode(const unsigned char* in, size_t len, 
+        unsigned char* out, size_t size) {
+    z_stream zs;
+    int ok;
+    memset(&zs, 0, sizeof(zs));
+    if (inflateInit2(&zs, -15) != Z_OK)
+        return 0;
+    zs.next_in = (unsigned char*)in;
+    zs.avail_in = (uInt)len;
+    zs.next_out = out;
+    zs.avail_out = (uInt)size;
+    ok = inflate(&zs, Z_FINISH) == Z_STREAM_END && zs.total_out == size;
+    inflateEnd(&zs);
+    return ok;
+}
+
+#ifdef HAVE_LIBDEFLATE
+// The same deflate data, inflated in one call as ExtractEntry does for
+// entries up to ONESHOTMAX
+static int LibdeflateDecode(const unsigned char* in, size_t len, 
+        unsigned char* out, size_t size) {
+    static struct libdeflate_decompressor* decompressor = NULL;
+    size_t actual = 0;
+    if (decompressor == NULL)
+        decompressor = libdeflate_alloc_decompressor();
+    return decompressor != NULL && libdeflate_deflate_decompress(
+        decompressor, in, len, out, size, &actual) == LIBDEFLATE_SUCCESS &&
+        actual == size;
+}
+#endif
+
+#ifdef HAVE_ZSTD
+static size_t ZstdBound(size_t len) {
+    return ZSTD_compressBound(len);
+}
+
+static size_t ZstdEncode(const unsigned char* in, size_t len, 
+        unsigned char* out, size_t cap) {
+    size_t packed = ZSTD_compress(out, cap, in, len, 3);
+    return ZSTD_isError(packed) ? 0 : packed;
+}
+
+static int ZstdDecode(const unsigned char* in, size_t len, 
+        unsigned char* out, size_t size) {
+    return ZSTD_decompress(out, size, in, len) == size;
+}
+#endif
+
+#ifdef HAVE_LZMA
+static size_t XzBound(size_t len) {
+    return lzma_stream_buffer_bound(len);
+}
+
+static size_t XzEncode(const unsigned char* in, size_t len, 
+        unsigned char* out, size_t cap) {
+    size_t packed = 0;
+    if (lzma_easy_buffer_encode(6, LZMA_CHECK_CRC64, NULL, in, len, out,
+            &packed, cap) != LZMA_OK)
+        return 0;
+    return packed;
+}
+
+static int XzDecode(const unsigned char* in, size_t len, 
+        unsigned char* out, size_t size) {
+    uint64_t memlimit = UINT64_MAX;
+    size_t inPos = 0, outPos = 0;
+    return lzma_stream_buffer_decode(&memlimit, 0, NULL, in, &inPos, len, 
+        out, &outPos, size) == LZMA_OK && outPos == size;
+}
+#endif
+
+static const CODEC CODECLIST[] = {
+    { "deflate", DeflateBound, DeflateEncode, DeflateDecode },
+#ifdef HAVE_LIBDEFLATE
+    { "libdeflate", DeflateBound, DeflateEncode, LibdeflateDecode },
+#endif
+#ifdef HAVE_ZSTD
+    { "zstd", ZstdBound, ZstdEncode, ZstdDecode },
+#endif
+#ifdef HAVE_LZMA
+    { "xz", XzBound, XzEncode, XzDecode },
+#endif
+};
+
+// Two results: encoding (with the total compressed size) and decoding.
+// Files that can't be loaded, or are empty, are left out of both.
+static int RunCodec(const PROFILE* p, const CODEC* codec, RESULT* encode,
+        RESULT* decode) {
+    uint64_t largest = 0;
+    double start;
+    int ok = 1;
+    for (long i = 0; i < p->count; i++) {
+        if (p->files[i].size > largest)
+            largest = p->files[i].size;
+    }
+    unsigned char* original = malloc(largest + 1);
+    unsigned char* packed = malloc(codec->bound(largest) + 1);
+    unsigned char* decoded = malloc(largest + 1);
+    if (original == NULL || packed == NULL || decoded == NULL)
+        ok = 0;
+    for (long i = 0; ok && i < p->count; i++) {
+        const FILESPEC* spec = &p->files[i];
+        if (spec->size == 0 || !LoadData(p, spec, original))
+            continue;
+        start = Now();
+        size_t len = codec->encode(original, spec->size, packed, 
+            codec->bound(spec->size));
+        encode->seconds += Now() - start;
+        if (len == 0) {
+            ok = 0;
+            break;
+        }
+        start = Now();
+        ok = codec->decode(packed, len, decoded, spec->size);
+        decode->seconds += Now() - start;
+        ok = ok && memcmp(original, decoded, spec->size) == 0;
+        encode->files++;
+        encode->bytes += spec->size;
+        encode->packed += len;
+        decode->files++;
+        decode->bytes += spec->size;
+        decode->packed += len;
+    }
+    free(original);
+    free(packed);
+    free(decoded);
+    return ok;
+}
+
+//============================================================================
+// One profile: generate, copy, make directories, extract, delete
+
+static void Start(RESULT* r, const char* profile, const char* op) {
+    memset(r, 0, sizeof(RESULT));
+    r->profile = profile;
+    r->op = op;
+    ResetPeakRss();
+    r->seconds = Now();
+}
+
+static void Stop(RESULT* r, int ok) {
+    r->seconds = Now() - r->seconds;
+    r->peakRssKb = PeakRssKb();
+    if (!ok)
+        fprintf(stderr, "%s: %s failed\n", r->profile, r->op);
+    Report(r);
+}
+
+static void RunCodecs(const PROFILE* p) {
+    char encodeOp[32], decodeOp[32];
+    RESULT encode, decode;
+    for (size_t i = 0; i < sizeof(CODECLIST) / sizeof(CODECLIST[0]); i++) {
+        snprintf(encodeOp, sizeof(encodeOp), "encode %s", 
+            CODECLIST[i].name);
+        snprintf(decodeOp, sizeof(decodeOp), "decode %s", 
+            CODECLIST[i].name);
+        memset(&encode, 0, sizeof(RESULT));
+        memset(&decode, 0, sizeof(RESULT));
+        encode.profile = decode.profile = p->name;
+        encode.op = encodeOp;
+        decode.op = decodeOp;
+        ResetPeakRss();
+        int ok = RunCodec(p, &CODECLIST[i], &encode, &decode);
+        encode.peakRssKb = decode.peakRssKb = PeakRssKb();
+        if (!ok)
+            fprintf(stderr, "%s: %s failed\n", p->name, CODECLIST[i].name);
+        Report(&encode);
+        Report(&decode);
+    }
+}
+
+// A generated profile, or with bundle set, that zip
+static int RunProfile(const char* name, const char* bundle, 
+        const char* workDir) {
+    PROFILE p;
+    RESULT r;
+    char zipfile[MAXPATH], copyfile[MAXPATH], outdir[MAXPATH];
+    uint64_t zipSize = 0, copied = 0;
+    long files = 0;
+    int ok;
+
+    // Cut short, these would name some other file
+    int fits = bundle != NULL ? 
+        snprintf(zipfile, sizeof(zipfile), "%s", bundle) < MAXPATH :
+        snprintf(zipfile, sizeof(zipfile), "%s/%s.zip", workDir, name) < 
+        MAXPATH;
+    fits = fits && snprintf(copyfile, sizeof(copyfile), "%s/%s.copy.zip", 
+        workDir, name) < MAXPATH;
+    fits = fits && snprintf(outdir, sizeof(outdir), "%s/%s.out", workDir, 
+        name) < MAXPATH;
+    if (!fits) {
+        fprintf(stderr, "Path too long: %s\n", workDir);
+        return 0;
+    }
+
+    if (bundle != NULL) {
+        if (!BuildBundle(&p, bundle)) {
+            fprintf(stderr, "Cannot read %s as a zip\n", bundle);
+            FreeProfile(&p);
+            return 0;
+        }
+    } else {
+        BuildProfile(&p, name);
+    }
+    uint64_t dataSize = ProfileBytes(&p);
+    DeleteTree(outdir);
+
+    if (bundle == NULL) {
+        Start(&r, name, "write zip");
+        ok = WriteZip(&p, zipfile, &zipSize);
+        r.files = p.count;
+        r.bytes = dataSize;
+        Stop(&r, ok);
+        if (!ok) {
+            FreeProfile(&p);
+            return 0;
+        }
+    }
+
+    Start(&r, name, "copy 4 KB");
+    ok = CopyStdio(zipfile, copyfile, &copied);
+    r.files = 1;
+    r.bytes = copied;
+    Stop(&r, ok);
+    unlink(copyfile);
+
+    Start(&r, name, "copy 4 MB");
+    ok = CopyLoop(zipfile, copyfile, COPYBLOCK, &copied);
+    r.files = 1;
+    r.bytes = copied;
+    Stop(&r, ok);
+    unlink(copyfile);
+
+    Start(&r, name, "copy offload");
+    ok = CopyOffload(zipfile, copyfile, &copied, &r.op);
+    r.files = 1;
+    r.bytes = copied;
+    Stop(&r, ok);
+    unlink(copyfile);
+
+    mkdir(outdir, 0755);
+    Start(&r, name, "mkdir per entry");
+    r.files = CreateDirsPerEntry(&p, outdir);   // Filesystem calls
+    Stop(&r, 1);
+    DeleteTree(outdir);
+
+    mkdir(outdir, 0755);
+    Start(&r, name, "mkdir once");
+    r.files = CreateDirsOnce(&p, outdir);
+    Stop(&r, 1);
+    DeleteTree(outdir);
+
+    mkdir(outdir, 0755);
+#ifdef HAVE_LIBZIP
+    Start(&r, name, "extract");
+    ok = ExtractZip(zipfile, &p, outdir, &files);
+#else
+    Start(&r, name, "write files");
+    ok = WriteFiles(&p, outdir, &files);
+#endif
+    r.files = files;
+    r.bytes = dataSize;
+    Stop(&r, ok);
+
+    Start(&r, name, "delete");
+    r.files = DeleteTree(outdir);
+    Stop(&r, 1);
+
+    // Offsets come from the zip's own directory, as Installer.c reads it
+    PROFILE zp;
+    int indexed = bundle != NULL || BuildBundle(&zp, zipfile);
+    if (bundle == NULL)
+        zp.name = name;
+    if (indexed) {
+        const PROFILE* z = bundle != NULL ? &p : &zp;
+        static const char* STOREDOPS[] = { "stored 4 KB", "stored offload" };
+        for (int offload = 0; offload < 2; offload++) {
+            uint64_t storedBytes = 0;
+            mkdir(outdir, 0755);
+            Start(&r, name, STOREDOPS[offload]);
+            int storedOk = CopyStoredEntries(z, outdir, offload, &r.files, 
+                &storedBytes);
+            r.bytes = storedBytes;
+            if (r.files > 0)
+                Stop(&r, storedOk);
+            ok = ok && storedOk;
+            DeleteTree(outdir);
+        }
+    }
+    if (bundle == NULL)
+        FreeProfile(&zp);
+
+    if (CODECS)
+        RunCodecs(&p);
+    if (!KEEP && bundle == NULL)
+        unlink(zipfile);
+    FreeProfile(&p);
+    return ok;
+}
+
+//============================================================================
+
+int main(int argc, char** argv) {
+    static const char* PROFILES[] = { "tiny", "huge", "deep", "random" };
+    const char* workDir = NULL;
+    const char* bundle = NULL;
+    int failed = 0;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--scale") == 0 && i + 1 < argc) {
+            SCALE = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+            THREADS = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--only") == 0 && i + 1 < argc) {
+            ONLY = argv[++i];
+        } else if (strcmp(argv[i], "--json") == 0) {
+            JSON = 1;
+        } else if (strcmp(argv[i], "--keep") == 0) {
+            KEEP = 1;
+        } else if (strcmp(argv[i], "--bundle") == 0 && i + 1 < argc) {
+            bundle = argv[++i];
+        } else if (strcmp(argv[i], "--codecs") == 0) {
+            CODECS = 1;
+        } else if (argv[i][0] != '-' && workDir == NULL) {
+            workDir = argv[i];
+        } else {
+            workDir = NULL;
+            break;
+        }
+    }
+    if (workDir == NULL || SCALE < 1) {
+        fprintf(stderr, "Usage: %s [--scale N] [--threads N] [--only P] "
+            "[--json] [--keep] [--bundle F] [--codecs] <work_dir>\n", 
+            argv[0]);
+        return 2;
+    }
+    if (THREADS <= 0)
+        THREADS = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    if (THREADS > MAXTHREADS)
+        THREADS = MAXTHREADS;
+    mkdir(workDir, 0755);
+
+    for (size_t i = 0; i < sizeof(PROFILES) / sizeof(PROFILES[0]); i++) {
+        if (ONLY != NULL && strcmp(ONLY, PROFILES[i]) != 0)
+            continue;
+        if (!RunProfile(PROFILES[i], NULL, workDir))
+            failed++;
+    }
+    if (bundle != NULL && (ONLY == NULL || strcmp(ONLY, "bundle") == 0) &&
+            !RunProfile("bundle", bundle, workDir))
+        failed++;
+    return failed > 0 ? 1 : 0;
+}